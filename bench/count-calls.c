@@ -0,0 +1,61 @@
+
+// Counts write system calls and heap allocations, for benchmarking.
+// Usage: LD_PRELOAD=./count-calls.so mobius ...
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long n_allocs      = 0;
+static unsigned long n_writes      = 0;
+static unsigned long bytes_written = 0;
+
+void* malloc(size_t size)
+{
+   ++n_allocs;
+   return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+   ++n_allocs;
+   return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+   ++n_allocs;
+   return __libc_realloc(ptr, size);
+}
+
+ssize_t write(int fd, const void* buf, size_t count)
+{
+   const ssize_t n = syscall(SYS_write, fd, buf, count);
+   ++n_writes;
+   if(n > 0) bytes_written += (unsigned long) n;
+   return n;
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt)
+{
+   const ssize_t n = syscall(SYS_writev, fd, iov, iovcnt);
+   ++n_writes;
+   if(n > 0) bytes_written += (unsigned long) n;
+   return n;
+}
+
+__attribute__((destructor)) static void report(void)
+{
+   fprintf(stderr,
+           "allocations %lu\nwrite-syscalls %lu\nbytes-written %lu\n",
+           n_allocs,
+           n_writes,
+           bytes_written);
+}
@@ -0,0 +1,228 @@
+// Generates a synthetic source tree, and a build.mobius to go with it, for
+// benchmarking mobius.
+//
+// Usage: make-tree [options] <dirname>
+//
+//    -n <files>     Number of source files (default 1000)
+//    -d <depth>     Depth of the directory tree (default 3)
+//    -w <width>     Subdirectories per directory (default 8)
+//    -x <mix>       Extension mix, as 'ext=weight,...' (default
+//                   'cpp=60,hpp=30,mxx=10'). '.mxx' files are module
+//                   interfaces.
+//    -p <density>   Fraction of '.cpp' and '.mxx' files that import
+//                   modules (default 0.5)
+//    -s <seed>      Random seed (default 1)
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+using std::string;
+using std::vector;
+
+struct Config
+{
+   unsigned n_files = 1000;
+   unsigned depth   = 3;
+   unsigned width   = 8;
+   vector<std::pair<string, unsigned>> mix{
+       {"cpp", 60}, {"hpp", 30}, {"mxx", 10}};
+   double import_density = 0.5;
+   unsigned seed         = 1;
+   string dirname;
+};
+
+static void usage(const char* exec_name)
+{
+   fprintf(stderr,
+           "Usage: %s [-n files] [-d depth] [-w width] [-x mix] "
+           "[-p density] [-s seed] <dirname>\n",
+           exec_name);
+   exit(EXIT_FAILURE);
+}
+
+static vector<std::pair<string, unsigned>> parse_mix(const string& s)
+{
+   vector<std::pair<string, unsigned>> mix;
+   size_t pos = 0;
+   while(pos < s.size()) {
+      auto end = s.find(',', pos);
+      if(end == string::npos) end = s.size();
+      const auto part = s.substr(pos, end - pos);
+      const auto eq   = part.find('=');
+      if(eq == string::npos)
+         mix.emplace_back(part, 1);
+      else
+         mix.emplace_back(part.substr(0, eq),
+                          unsigned(atoi(part.substr(eq + 1).c_str())));
+      pos = end + 1;
+   }
+   return mix;
+}
+
+static Config parse_commandline(int argc, char** argv)
+{
+   Config config;
+   for(int i = 1; i < argc; ++i) {
+      const string arg = argv[i];
+      auto next        = [&]() -> string {
+         if(++i >= argc) usage(argv[0]);
+         return argv[i];
+      };
+      if(arg == "-n")
+         config.n_files = unsigned(atol(next().c_str()));
+      else if(arg == "-d")
+         config.depth = unsigned(atoi(next().c_str()));
+      else if(arg == "-w")
+         config.width = unsigned(atoi(next().c_str()));
+      else if(arg == "-x")
+         config.mix = parse_mix(next());
+      else if(arg == "-p")
+         config.import_density = atof(next().c_str());
+      else if(arg == "-s")
+         config.seed = unsigned(atoi(next().c_str()));
+      else if(!arg.empty() && arg[0] != '-' && config.dirname.empty())
+         config.dirname = arg;
+      else
+         usage(argv[0]);
+   }
+   if(config.dirname.empty() || config.mix.empty() || config.width == 0)
+      usage(argv[0]);
+   return config;
+}
+
+static void make_dir(const string& dirname)
+{
+   if(mkdir(dirname.c_str(), 0777) != 0 && errno != EEXIST) {
+      fprintf(stderr,
+              "failed to create '%s': %s\n",
+              dirname.c_str(),
+              strerror(errno));
+      exit(EXIT_FAILURE);
+   }
+}
+
+static void write_file(const string& filename, const string& contents)
+{
+   FILE* fp = fopen(filename.c_str(), "w");
+   if(fp == nullptr
+      || fwrite(contents.data(), 1, contents.size(), fp) != contents.size()
+      || fclose(fp) != 0) {
+      fprintf(stderr, "failed to write '%s'\n", filename.c_str());
+      exit(EXIT_FAILURE);
+   }
+}
+
+// The leaf directories of a tree 'depth' deep and 'width' wide
+static vector<string> make_directories(const Config& config)
+{
+   vector<string> dirs{config.dirname + "/src"};
+   make_dir(config.dirname);
+   make_dir(dirs[0]);
+   for(auto level = 0u; level < config.depth; ++level) {
+      vector<string> next;
+      for(const auto& dir : dirs)
+         for(auto i = 0u; i < config.width; ++i) {
+            next.push_back(dir + "/d" + std::to_string(i));
+            make_dir(next.back());
+         }
+      dirs = std::move(next);
+   }
+   return dirs;
+}
+
+// A preamble typical of real code: a licence, a global module fragment,
+// and the module declaration and imports.
+static string make_source(const string& ext,
+                          unsigned ind,
+                          unsigned n_modules,
+                          double import_density,
+                          std::mt19937& rng)
+{
+   string s = "// Copyright (c) Somebody. Distributed under the MIT licence.\n"
+              "// This file was generated by make-tree, for benchmarking.\n\n";
+
+   const bool is_module = (ext == "mxx");
+   if(is_module) s += "module;\n";
+   s += "#include <vector>\n#include \"config.h\"\n\n";
+   if(is_module) s += "export module m" + std::to_string(ind) + ";\n";
+
+   // Modules only import earlier modules, so there are no cycles
+   const auto n_importable = is_module ? ind : n_modules;
+   std::uniform_real_distribution<double> coin(0.0, 1.0);
+   if(ext != "hpp" && n_importable > 0 && coin(rng) < import_density) {
+      std::uniform_int_distribution<unsigned> pick(0, n_importable - 1);
+      for(auto i = 0u; i < 3; ++i)
+         s += "import m" + std::to_string(pick(rng)) + ";\n";
+   }
+
+   s += "\nnamespace bench\n{\nint f" + std::to_string(ind)
+        + "() { return " + std::to_string(ind) + "; }\n} // namespace bench\n";
+   return s;
+}
+
+static string make_build_mobius()
+{
+   return R"V0G0N(# Generated by make-tree
+builddir = build
+moduledir = $builddir/modules
+
+rule cpp
+   command = c++ -fmodules-ts -c $in -o $out
+rule mpp
+   command = c++ -fmodules-ts --precompile $in -o $out
+rule check
+   command = c++ -fsyntax-only $in && touch $out
+rule link
+   command = c++ $in -o $out
+
++src OBJS=*.o HEADERS=*.hpp src
+- *.mxx    build $moduledir/#.pcm:   mpp ^ | ?
+- *.cpp    build $builddir/%.o:      cpp ^ | ?
+- *.hpp    build $builddir/%.check:  check ^
+
+build $builddir/app: link ${OBJS}
+build headers: phony ${HEADERS}
+)V0G0N";
+}
+
+int main(int argc, char** argv)
+{
+   const auto config = parse_commandline(argc, argv);
+   std::mt19937 rng(config.seed);
+
+   // Pick each file's extension from the weighted mix
+   vector<unsigned> weights;
+   for(const auto& [ext, weight] : config.mix) weights.push_back(weight);
+   std::discrete_distribution<unsigned> pick_ext(weights.begin(),
+                                                 weights.end());
+
+   vector<unsigned> exts(config.n_files);
+   unsigned n_modules = 0;
+   for(auto& ext : exts) {
+      ext = pick_ext(rng);
+      if(config.mix[ext].first == "mxx") ++n_modules;
+   }
+
+   // Spread the files over the leaf directories
+   const auto dirs = make_directories(config);
+   unsigned module_ind = 0;
+   for(auto i = 0u; i < config.n_files; ++i) {
+      const auto& ext = config.mix[exts[i]].first;
+      const auto ind  = (ext == "mxx") ? module_ind++ : i;
+      const auto filename
+          = dirs[i % dirs.size()] + "/f" + std::to_string(i) + "." + ext;
+      write_file(filename,
+                 make_source(ext, ind, n_modules, config.import_density, rng));
+   }
+
+   write_file(config.dirname + "/build.mobius", make_build_mobius());
+   return EXIT_SUCCESS;
+}
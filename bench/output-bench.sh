@@ -0,0 +1,56 @@
+#!/bin/bash
+
+# Counts heap allocations and write system calls made by mobius while
+# generating a 100k edge manifest.
+#
+# Usage: bench/output-bench.sh [path/to/mobius...]
+
+set -e
+set -o pipefail
+
+cd "$(dirname "$0")/.."
+[ "$#" = "0" ] && set -- ./mobius
+
+TMPD=$(mktemp -d /tmp/$(basename $0).XXXXX)
+trap cleanup EXIT
+cleanup()
+{
+    rm -rf $TMPD
+}
+
+# ---- The counter
+gcc -shared -fPIC -O2 bench/count-calls.c -o $TMPD/count-calls.so
+
+# ---- 100 directories of 1000 (empty) source files
+for D in $(seq 0 99) ; do
+    mkdir -p $TMPD/src/d$D
+    (cd $TMPD/src/d$D && seq 0 999 | sed 's/$/.cpp/' | xargs touch)
+done
+
+cat > $TMPD/build.mobius <<EOM
+builddir = build
+
++src cd=$TMPD OBJS=*.o src
+- *.cpp    build \$builddir/%.o: cpp ^
+
+build app: link \${OBJS}
+EOM
+
+# ---- Run each mobius
+for MOBIUS in "$@" ; do
+    echo "$MOBIUS"
+
+    # One thread where there is a choice; older builds have no -j
+    HELP="$("$MOBIUS" --help 2>&1 || true)"
+    JOBS=
+    grep -q '^ *-j <n>' <<< "$HELP" && JOBS=-j1
+
+    rm -f $TMPD/build.ninja
+    LD_PRELOAD=$TMPD/count-calls.so "$MOBIUS" $JOBS \
+              -i $TMPD/build.mobius -o $TMPD/build.ninja 2>&1 | sed 's/^/    /'
+    if ! [ -f $TMPD/build.ninja ] ; then
+        echo "$MOBIUS did not write build.ninja" 1>&2
+        exit 1
+    fi
+    echo "    edges $(grep -c '^build' $TMPD/build.ninja)"
+done
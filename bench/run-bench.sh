@@ -0,0 +1,102 @@
+#!/bin/bash
+
+# Times each phase of mobius (see --timings) on synthetic source trees of
+# increasing size, and optionally compares the results against a baseline.
+#
+# Usage: bench/run-bench.sh [options] [path/to/mobius]
+#
+#    -n "<sizes>"   Tree sizes, in files (default "1000 10000 100000"); up
+#                   to 1000000 is reasonable
+#    -d <depth>     Directory depth of each tree (default 3)
+#    -x <mix>       Extension mix (default cpp=60,hpp=30,mxx=10)
+#    -p <density>   Module import density (default 0.5)
+#    -r <runs>      Runs of each tree; the fastest is kept (default 5)
+#    -o <file>      Write the results here, as well as to stdout
+#    -b <file>      Compare against these results, from a previous -o
+#    -t <ratio>     Slow-down, over the baseline, that fails (default 1.25)
+#
+# Results are tab-separated values: files, phase, seconds. With -b the
+# script exits with an error if any phase regressed.
+#
+# e.g.: bench/run-bench.sh -o baseline.tsv ./mobius
+#       ... make changes ...
+#       bench/run-bench.sh -b baseline.tsv ./mobius
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+SIZES="1000 10000 100000"
+DEPTH=3
+MIX="cpp=60,hpp=30,mxx=10"
+DENSITY=0.5
+RUNS=5
+OUT_FILE=
+BASELINE=
+THRESHOLD=1.25
+
+while getopts "n:d:x:p:r:o:b:t:" OPT ; do
+    case $OPT in
+        n) SIZES="$OPTARG" ;;
+        d) DEPTH="$OPTARG" ;;
+        x) MIX="$OPTARG" ;;
+        p) DENSITY="$OPTARG" ;;
+        r) RUNS="$OPTARG" ;;
+        o) OUT_FILE="$OPTARG" ;;
+        b) BASELINE="$OPTARG" ;;
+        t) THRESHOLD="$OPTARG" ;;
+        *) exit 1 ;;
+    esac
+done
+shift $(($OPTIND - 1))
+MOBIUS="$(realpath "${1:-./mobius}")"
+
+TMPD=$(mktemp -d /tmp/$(basename $0).XXXXX)
+trap cleanup EXIT
+cleanup()
+{
+    rm -rf $TMPD
+}
+
+# ---- The tree generator
+g++ -std=c++17 -O2 bench/make-tree.cpp -o $TMPD/make-tree
+
+# ---- Time each tree, keeping the fastest run of each phase
+RESULTS=$TMPD/results.tsv
+printf "files\tphase\tseconds\n" > $RESULTS
+for N in $SIZES ; do
+    TREE=$TMPD/tree-$N
+    $TMPD/make-tree -n $N -d $DEPTH -x $MIX -p $DENSITY $TREE
+    for RUN in $(seq 1 $RUNS) ; do
+        (cd $TREE && "$MOBIUS" -i build.mobius -o build.ninja -m build/modules \
+                               --timings $TMPD/run-$RUN.tsv)
+    done
+    cat $TMPD/run-*.tsv | awk -v N=$N '
+        $1 == "phase" { next }
+        !($1 in best) || $2 < best[$1] { best[$1] = $2 }
+        !($1 in order) { order[$1] = n++; names[n - 1] = $1 }
+        END { for(i = 0; i < n; ++i)
+                  printf("%d\t%s\t%.6f\n", N, names[i], best[names[i]]) }
+    ' >> $RESULTS
+    rm -rf $TREE $TMPD/run-*.tsv
+done
+
+cat $RESULTS
+[ "$OUT_FILE" != "" ] && cp $RESULTS "$OUT_FILE"
+
+# ---- Compare against the baseline. Phases under a millisecond are noise.
+[ "$BASELINE" = "" ] && exit 0
+echo
+awk -v T=$THRESHOLD '
+    FNR == 1 { next }
+    NR == FNR { base[$1 "\t" $2] = $3; next }
+    ($1 "\t" $2) in base {
+        old = base[$1 "\t" $2]
+        ratio = (old > 0) ? $3 / old : 1
+        bad = (ratio > T && $3 - old > 0.001)
+        printf("%8d  %-12s %10.6f -> %10.6f  x%.2f%s\n",
+               $1, $2, old, $3, ratio, bad ? "  REGRESSION" : "")
+        if(bad) ++regressions
+    }
+    END { if(regressions > 0) exit 1 }
+' "$BASELINE" $RESULTS
@@ -133,9 +133,11 @@ if [ "$NO_BUILD" = "1" ] ; then
     exit $?
 fi
 
-# Ensure that we've got the latest build.ninja file
+# Ensure that we've got the latest build.ninja file. It's only rewritten if
+# it changed, and ninja itself reruns mobius if anything it read changes.
 NINJA_FILE="$(dirname "$TARGET")/build.ninja"
-! cat build-config/build.mobius | mobius -m \$moduledir - > "$NINJA_FILE" \
+! mobius -m \$moduledir -i build-config/build.mobius -o "$NINJA_FILE" \
+         --depfile "$NINJA_FILE.d" \
     && exit 1
 
 [ "$TARGET" = "build.ninja" ] && exit 0
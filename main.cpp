@@ -1,4 +1,3 @@
-
 // Copyright (c) 2018, Aaron Michaux
 // All rights reserved.
 
@@ -20,136 +19,48 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
-#include <assert.h>
-#include <ftw.h>
-#include <libgen.h>
+// The mobius executable: a command line over the engine (see mobius.hpp),
+// and the daemon (--serve) that keeps an engine between runs, along with
+// its thin client (--connect).
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 
 #include <algorithm>
-#include <cctype>
-#include <deque>
-#include <fstream>
 #include <iostream>
-#include <regex>
-#include <sstream>
+#include <iterator>
+#include <stdexcept>
 #include <string>
 #include <string_view>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
-#include <experimental/filesystem>
-namespace fs = std::experimental::filesystem;
+#include "mobius.hpp"
 
-using std::cout;
-using std::endl;
-using std::istream;
-using std::ostream;
+using mobius::Options;
 using std::string;
 using std::string_view;
 using std::unordered_map;
 using std::vector;
 
-using namespace std::string_literals;
-
-// ------------------------------------------------------------ global variables
-
-static const char* empty_directory = "";
-
-// ------------------------------------------------------------------ structures
-
-struct Options
-{
-   bool show_help                             = false;
-   bool has_error                             = false;
-   bool unity_build                           = true;
-   string module_dir                          = "";
-   string in_file                             = "";
-   string out_file                            = "";
-   std::unordered_map<string, string> defines = {};
-};
-
-struct State
-{
-   State(const Options& opts_, istream& in_, ostream& out_)
-       : opts(opts_)
-       , in(in_)
-       , out(out_)
-   {
-      auto cwd                  = getcwd(nullptr, 0);
-      current_working_directory = cwd;
-      free(cwd);
-
-      // for stdin, stdout, stderr
-      n_descriptors = sysconf(_SC_OPEN_MAX) - 3;
-
-      env.insert(opts.defines.begin(), opts.defines.end());
-   }
-
-   bool has_error{false};
-
-   const Options& opts;
-   istream& in;
-   ostream& out;
-   std::deque<string> lines;
-   string current_working_directory{""};
-   vector<string> additional_filenames;
-   vector<string_view> additional_dirnames;
-   unordered_map<string, string> env; // cached environment variables
-
-   int n_descriptors{0};
-};
-
-struct FileCommand
-{
-   string pattern;
-   std::regex glob;
-   string command;
-   vector<string> re_add_outputs;
-   vector<string> other_outputs;
-};
-
-struct FilterVariable
-{
-   string variable;
-   string filter;
-   std::regex glob;
-   std::deque<string> products;
-};
-
 // -------------------------------------------------------------- predefinitions
 
 static void show_help(const char* exec_name);
-static Options parse_commandline(int argc, char** argv);
-
-// Environment variables
-static void substitute_env_variables(State& state, string& line_s, bool strict);
-
-// String functions
-static bool starts_with(const std::string& s, const std::string& prefix);
-static void ltrim(std::string& s);
-static void rtrim(std::string& s);
-static void trim(std::string& s);
-static bool is_empty_line(const std::string& s);
+static string executable_path();
 
-// Turns a glob pattern into a regex.
-static std::regex make_glob(const string& pattern);
-
-// Runs an individual matched substitution
-static void command_substitute(State& state,
-                               const string& fname,
-                               const string_view dname,
-                               const FileCommand& cmd,
-                               vector<FilterVariable>& filters);
-
-// Runs an entire +src command
-static void process_src_command(State& state, const vector<string> command);
-
-// The actual pipeline
-static bool transform_input(State& state);
+// The daemon, and its thin client
+static bool serve(const Options& opts);
+static bool run_client(const Options& opts, int argc, char** argv, int& status);
 
 // ------------------------------------------------------------------- show-help
 
@@ -159,7 +70,8 @@ static void show_help(const char* exec_name)
    Usage: %s [OPTIONS...] -i <filename>
 
       -i <filename>    Input filename (required); '-' for stdin
-      -o <filename>    Output filename
+      -o <filename>    Output filename. The file is only replaced if its
+                       contents change.
       -D <var=value>   Set variable 'var' to 'value', as if an 
                        environment variable.=
 
@@ -167,8 +79,122 @@ static void show_help(const char* exec_name)
                        to module dependencies discovered by the '?'
                        character.
 
+      -c <filename>    Scan cache file. Directory listings, module
+                       dependences ('?'), and the output of each +src block
+                       are saved here, and reused by the next run if
+                       nothing they depend on has changed.
+
+      -j <n>           Number of threads used to search directories;
+                       defaults to the number of cores.
+
+      --shard          Write each +src block's build statements to its own
+                       file, '<output>.shards/<n>.ninja', which the output
+                       includes with 'subninja'. Requires -o <filename>.
+
+      --depfile <filename>
+                       Write everything that the output depends on (the
+                       input file, every directory listed, and every
+                       file scanned for '?') to <filename>, as a depfile,
+                       and add a 'generator = 1' edge to the output, so
+                       that ninja reruns mobius, with the same options
+                       and variables, whenever any of them change.
+                       Requires -i <filename> and -o <filename>.
+
+      --dyndep <dirname>
+                       Find module dependences ('?') when building,
+                       instead of now. Each source file gets an edge that
+                       scans it ('--scan-deps'), and each +src block an
+                       edge that collates the scans ('--collate') into a
+                       ninja dyndep file, which the block's build
+                       statements use. Scans and dyndep files go in
+                       <dirname>. Only adding or removing files then needs
+                       mobius to run again.
+
+      --scan-deps <filename>
+                       Scan the source <filename> for the modules that it
+                       provides and requires, and write them as P1689
+                       JSON, to -o <filename> or stdout. The rule's
+                       'primary-output' is set with
+                       '--primary-output <filename>'.
+
+      --collate [<filename>|@<filename>...]
+                       Read P1689 JSON files (or lists of them, from
+                       '@' response files), and write a ninja dyndep file
+                       (to -o <filename> or stdout) that makes each rule's
+                       primary output depend on the prebuilt modules
+                       (-m <dirname>/name.pcm) that it requires.
+
+      --timings <filename>
+                       Write the time spent in each phase of the run
+                       (walk, match, substitute, scan, filter, output, and
+                       other) to <filename>, as tab-separated values.
+
+      --stats          Print the wall and cpu time of each phase, and of
+                       each +src block, with counts of files visited,
+                       rule matches, glob evaluations, bytes scanned for
+                       '?', and bytes written, to stderr.
+
+      --trace=<filename>
+                       Write the phases and +src blocks of the run to
+                       <filename>, in Chrome's trace event format (JSON),
+                       for viewing in chrome://tracing or Perfetto.
+
+      --serve <socket> Run as a daemon, listening on the unix <socket>. It
+                       keeps directory listings, '?' scans and +src
+                       block outputs in memory, and watches the
+                       directories (with inotify) so that a repeated
+                       request, with nothing changed, returns at once.
+
+      --connect <socket>
+                       Have the daemon on <socket> do this run, with
+                       this working directory and environment. Runs here
+                       instead if there's no daemon. The output is the
+                       same either way.
+
+      --config <name>:-D<var=value>
+                       Add a configuration, with its own variables (set
+                       over those of -D). Repeat it to set more variables,
+                       or add more configurations. Directories are searched,
+                       and files scanned for '?', once, and then each
+                       configuration's output is written in parallel.
+                       '{config}' in -o, --depfile, --timings, --trace,
+                       --dyndep, --diff and -m is replaced with the name,
+                       and with several configurations, -o (and
+                       --depfile, --timings and --trace, if given) must
+                       contain it. Runs here, even with --connect.
+
+      --regex-globs    Match file patterns using std::regex, instead of
+                       the (much faster) built-in glob matcher.
+
+      --no-unity       Ignore 'unity=' options, so that every source file
+                       gets its own build statement.
+
+      --diff <filename>
+                       Compare the output with the ninja manifest
+                       <filename> (read before the output is written, so
+                       it may be the output itself), and print the build
+                       statements that were added, removed or changed
+                       (and how), and the rules that changed, to stderr.
+                       Variables are expanded, and 'include' and
+                       'subninja' followed (from the working directory),
+                       as ninja does. Requires -o <filename>.
+
+      --check-modules  Check the modules that the files scanned for '?'
+                       (by every +src block) provide and import: warn of
+                       modules that no such file provides (which may be
+                       prebuilt), and stop if a module has several
+                       providers, or if modules import each other in a
+                       cycle. The output, and any shards, are then left
+                       untouched (but unity= files may be rewritten). Not
+                       with --dyndep.
+
+      --module-depth   As --check-modules, and print the longest chain of
+                       imports, which the build compiles one at a time.
+
    Mobuis is a preprocessor for ninja.build files. It adds two features:
    (1) Environment variable substitution using ${USER} like syntax.
+       ${VAR:-default} expands 'default' if VAR is unset or empty, and
+       ${VAR:?message} stops with 'message' if VAR is unset or empty.
    (2) +src commands that search directory structures and generate build rules.
 
    An example +src command is as follows:
@@ -186,6 +212,36 @@ static void show_help(const char* exec_name)
    Any outputs that match '*.o' are put into the OBJS environment variable, 
    which can be later expanded.
 
+   Files are found, build statements written, and filter variables (like
+   OBJS) listed, in one canonical order, whatever the filesystem: each
+   directory's entries sorted by name, depth first (so full paths compare
+   as if '/' came before any other character). A filter variable lists
+   any 'main.cpp' (or '.cc', '.cxx', '.c') files first. (Older versions
+   sorted filter variables as plain strings, so a variable like OBJS may
+   be reordered once on upgrading, which relinks what uses it.)
+
+   File patterns are globs, where '*' matches any sequence of characters
+   (including '/'), '?' matches any single character, '**/' matches zero
+   or more directories, '[a-z]' and '[!a-z]' are character classes, and
+   '\' makes the next character literal. (Older versions matched '[', ']'
+   and '\' literally, and '**/' as '*/', as --regex-globs still does.)
+
+   The search skips files and directories that match an 'exclude=<glob>'
+   (a directory matches with or without a trailing '/', as in
+   'exclude=*/.git'), and those ignored by any 'ignore=<filename>' files
+   (i.e., 'ignore=.gitignore ignore=.mobiusignore'), which are read in
+   each directory, in '.gitignore' format. Directories that no '-' line
+   could match (because of its leading literal text, like 'src/') are
+   skipped too. Symlinks are followed, but a directory reached twice is
+   only searched where it is first found.
+
+   With 'from=git', the files are read from the git index (.git/index) of
+   the enclosing repository, instead of searching directories: only
+   tracked files are found (including any deleted since, until the
+   deletion is staged), and only 'exclude=' applies. 'from=git+untracked'
+   also searches the directories for untracked files that '.gitignore'
+   files don't ignore.
+
    Every file is matched against the first possible '-' line.
    (A '~' line is merely an extension of the previous '-' line.)
    When the match is made, then output is generated by text substitution, where:
@@ -194,66 +250,34 @@ static void show_help(const char* exec_name)
    + '#' same as '%%', but without the search directory, and '/' => '.'
    + '@' is dirname(filename)
    + '&' is basename(filename)
+   + '?' is the prebuilt modules (-m <dirname>/name.pcm) that the file
+     imports, or implements, found by scanning the top of the file
    If a ninja build product ends in a '!', then it is added to the list
    of files found on the +src line, to be later processed through 
    the '-' sequence.
 
+   With 'unity=<n>', each rule's C and C++ sources are compiled <n> at a
+   time: mobius writes (if changed) a unity file that includes them, in
+   'unity_dir=<dirname>' (default 'unity'), and substitutes it into the
+   rule in their place, where '?' is every module that they import. A
+   unity file is named for the sources that it includes, so --config
+   runs whose sources differ never share one.
+   'unity_by=dir' batches each directory's sources apart. Sources that
+   declare modules (and, with --dyndep, any source for '?') are left alone.
+
 )V0G0N",
           exec_name);
 }
 
-// ---------------------------------------------------------- parse command-line
+// ------------------------------------------------------------- executable-path
 
-static Options parse_commandline(int argc, char** argv)
+// This executable, for the commands that the output runs (--depfile, --dyndep)
+static string executable_path()
 {
-   Options opts;
-
-   auto safe_s = [&](int& ind) -> string {
-      ++ind;
-      if(ind >= argc) {
-         fprintf(stderr, "Expected argument after '%s'.\n", argv[ind]);
-         opts.has_error = true;
-         return "";
-      }
-      return argv[ind];
-   };
-
-   auto process_define = [&](const string& s) {
-      auto pos = s.find('=');
-      if(pos == string::npos)
-         opts.defines[s] = "";
-      else
-         opts.defines[s.substr(0, pos)] = s.substr(pos + 1);
-   };
-
-   for(int i = 1; i < argc && !opts.has_error; ++i) {
-      string arg = argv[i];
-      if(arg == "-h" || arg == "--help") {
-         opts.show_help = true;
-      } else if(arg == "-i") {
-         opts.in_file = safe_s(i);
-      } else if(arg == "-") {
-         opts.in_file = arg;
-      } else if(arg == "-o") {
-         opts.out_file = safe_s(i);
-      } else if(arg == "-m") {
-         opts.module_dir = safe_s(i);
-      } else if(arg == "-D") {
-         process_define(safe_s(i));
-      } else if(starts_with(arg, "-D")) {
-         process_define(&arg[2]);
-      } else {
-         fprintf(stderr, "Unknown argument '%s'.\n", argv[i]);
-         opts.has_error = true;
-      }
-   }
-
-   if(!opts.show_help && opts.in_file == "") {
-      fprintf(stderr, "Must specify an input file.\n");
-      opts.has_error = true;
-   }
-
-   return opts;
+   char buf[4096];
+   const auto len = readlink("/proc/self/exe", buf, sizeof(buf));
+   return (len > 0 && size_t(len) < sizeof(buf)) ? string(buf, size_t(len))
+                                                  : string("mobius");
 }
 
 // ------------------------------------------------------------------------ main
@@ -261,7 +285,8 @@ static Options parse_commandline(int argc, char** argv)
 int main(int argc, char** argv)
 {
    // -- Parse command-line
-   auto opts = parse_commandline(argc, argv);
+   auto opts           = mobius::parse_commandline(argc, argv);
+   opts.mobius_command = executable_path();
 
    // -- Analyze options
    if(opts.show_help) {
@@ -271,639 +296,413 @@ int main(int argc, char** argv)
       return EXIT_FAILURE;
    }
 
-   // -- Setup input/output files
-   std::istream* in  = nullptr;
-   std::ostream* out = nullptr;
-   std::ifstream fin;
-   std::ofstream fout;
-   if(opts.in_file == "-") {
-      in = &std::cin;
-   } else {
-      try {
-         fin.open(opts.in_file);
-         in = &fin;
-      } catch(...) {}
-   }
+   // -- The build-time halves of --dyndep
+   if(!opts.scan_deps_file.empty())
+      return mobius::scan_deps(opts) ? EXIT_SUCCESS : EXIT_FAILURE;
+   if(opts.collate) return mobius::collate(opts) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-   if(opts.out_file == "-" || opts.out_file == "")
-      out = &std::cout;
-   else {
-      try {
-         fout.open(opts.out_file);
-         out = &fout;
-      } catch(...) {}
-   }
+   // -- Serve, or be a client of, a daemon
+   if(!opts.serve_socket.empty())
+      return serve(opts) ? EXIT_SUCCESS : EXIT_FAILURE;
 
-   if(!in->good())
-      fprintf(stderr, "failed to open input file '%s'\n", opts.in_file.c_str());
-   if(!out->good())
-      fprintf(
-          stderr, "failed to open output file '%s'\n", opts.out_file.c_str());
-
-   // -- Transform input into output
-   try {
-      if(in->good() && out->good()) {
-         State state(opts, *in, *out);
-         if(transform_input(state)) return EXIT_SUCCESS;
-      }
-   } catch(std::exception& e) {
-      string err = e.what();
-      fprintf(stderr, "exception tranforming input: \"%s\"\n", err.c_str());
-   }
+   int status = EXIT_FAILURE;
+   if(!opts.connect_socket.empty() && opts.configs.empty()
+      && run_client(opts, argc, argv, status))
+      return status;
 
-   // -- Done
-   return EXIT_FAILURE;
+   // -- Otherwise (or if there's no daemon) run here
+   mobius::Generation generation(opts);
+   return mobius::generate(nullptr, generation) ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-// ------------------------------------------------ cached environment variables
+// ----------------------------------------------------------------------- serve
 
-static decltype(auto) getenv(State& state, const string& s)
+// Messages between client and daemon are lists of strings, each of which
+// is sent as a 64-bit length and then its bytes.
+static bool send_all(int fd, const void* data, size_t size)
 {
-   auto ii = state.env.find(s);
-   if(ii == state.env.end()) {
-      auto var = getenv(s.c_str());
-      if(var == nullptr) return state.env.end();
-      state.env[s] = string(var);
-      ii           = state.env.find(s);
+   auto ptr = static_cast<const char*>(data);
+   while(size > 0) {
+      const auto n = send(fd, ptr, size, MSG_NOSIGNAL);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      ptr += n;
+      size -= size_t(n);
    }
-   return ii;
+   return true;
 }
 
-static void substitute_env_variables(State& state, string& line_s, bool strict)
+static bool recv_all(int fd, void* data, size_t size)
 {
-   auto pos = line_s.find('$');
-   if(pos == string::npos) return;
-
-   string_view line(line_s);
-   const auto len = int(line.size());
-
-   std::stringstream ss("");
-   ss << line.substr(0, pos);
-
-   auto process_variable = [&](int& i) {
-      assert(line[i] == '$');
-      if(++i == len) return;
-      if(line[i] != '{') {
-         ss << '$';
-         ss << line[i];
-         return;
-      }
-
-      auto pos = line.find('}', i);
-      if(pos == string::npos)
-         throw std::runtime_error("parse error reading variable name, "
-                                  "missing '}'");
-
-      string variable(line.substr(i + 1, pos - i - 1));
-      const auto value = getenv(state, variable);
-      if(value == state.env.end()) {
-         if(strict) {
-            throw std::runtime_error("environment variable '" + variable
-                                     + "' not found");
-         }
-         ss << '$' << '{' << variable << '}';
-      } else {
-         ss << value->second;
-      }
-      i = pos;
-   };
-
-   for(auto i = int(pos); i < len; ++i) {
-      if(line[i] == '$')
-         process_variable(i);
-      else
-         ss << line[i];
+   auto ptr = static_cast<char*>(data);
+   while(size > 0) {
+      const auto n = recv(fd, ptr, size, 0);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      ptr += n;
+      size -= size_t(n);
    }
-
-   line_s = ss.str();
-}
-
-// -----------------------------------------------------------------------------
-// --                           String Funcitons                              --
-// -----------------------------------------------------------------------------
-
-// ----------------------------------------------------------------- starts-with
-
-static bool starts_with(const std::string& s, const std::string& prefix)
-{
-   auto pos = 0u;
-   while(pos < s.size() && std::isspace(s[pos])) ++pos;
-   return std::mismatch(prefix.begin(), prefix.end(), s.begin() + pos, s.end())
-              .first
-          == prefix.end();
-}
-
-// ------------------------------------------------------------------------ trim
-
-static void ltrim(std::string& s)
-{
-   s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](int ch) {
-              return !std::isspace(ch);
-           }));
+   return true;
 }
 
-// trim from end (in place)
-static void rtrim(std::string& s)
+static bool send_message(int fd, const vector<string>& message)
 {
-   s.erase(std::find_if(
-               s.rbegin(), s.rend(), [](int ch) { return !std::isspace(ch); })
-               .base(),
-           s.end());
+   string data;
+   auto write_u64 = [&](uint64_t x) {
+      data.append(reinterpret_cast<const char*>(&x), sizeof(x));
+   };
+   write_u64(message.size());
+   for(const auto& s : message) {
+      write_u64(s.size());
+      data += s;
+   }
+   return send_all(fd, data.data(), data.size());
 }
 
-// trim from both ends (in place)
-static void trim(std::string& s)
+// Also returns the raw bytes of the message, if 'raw' is not null. Fails on
+// a message of more than 'max_bytes', or 'k_max_entries' strings. Strings
+// grow as their bytes arrive, so a bad length costs no more than the bytes
+// that are actually sent.
+static constexpr uint64_t k_max_entries       = 1 << 20;
+static constexpr uint64_t k_max_request_bytes = 64 << 20;
+static constexpr uint64_t k_no_limit          = ~uint64_t(0);
+
+static bool recv_message(int fd,
+                         vector<string>& message,
+                         string* raw,
+                         uint64_t max_bytes)
 {
-   ltrim(s);
-   rtrim(s);
-}
+   uint64_t total = 0;
+   auto read_u64  = [&](uint64_t& x) {
+      if(!recv_all(fd, &x, sizeof(x))) return false;
+      if(raw != nullptr)
+         raw->append(reinterpret_cast<const char*>(&x), sizeof(x));
+      total += sizeof(x);
+      return total <= max_bytes && x <= max_bytes - total;
+   };
 
-static bool is_empty_line(const std::string& s)
-{
-   for(auto c : s)
-      if(!std::isspace(c)) return false;
+   uint64_t n = 0;
+   if(!read_u64(n) || n > k_max_entries) return false;
+   message.clear();
+   for(auto i = 0u; i < n; ++i) {
+      uint64_t size = 0;
+      if(!read_u64(size)) return false;
+      total += size;
+      auto& s = message.emplace_back();
+      while(s.size() < size) {
+         const auto offset = s.size();
+         s.resize(offset + std::min<uint64_t>(size - offset, 1 << 20));
+         if(!recv_all(fd, &s[offset], s.size() - offset)) return false;
+      }
+      if(raw != nullptr) raw->append(s);
+   }
    return true;
 }
 
-template<class U, class V> static bool ends_with(const U& input, const V& match)
+static sockaddr_un make_socket_address(const string& path)
 {
-   return input.size() >= match.size()
-          and std::equal(crbegin(match), crend(match), rbegin(input));
+   sockaddr_un addr;
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   if(path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("socket path too long: '" + path + "'");
+   memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+   return addr;
 }
 
-// ------------------------------------------------------------------- make-glob
-
-static std::regex make_glob(const string& pattern)
+// The directories watched with inotify
+struct Watches
 {
-   int len         = pattern.size();
-   int pos         = 0;
-   char* buffer    = static_cast<char*>(alloca(len * 2 + 1));
-   const char* src = pattern.c_str();
-
-   while(*src) {
-      switch(*src) {
-      case '\\':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '\\';
-         break;
-      case '^':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '^';
-         break;
-      case '.':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '.';
-         break;
-      case '$':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '$';
-         break;
-      case '|':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '|';
-         break;
-      case '(':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '(';
-         break;
-      case ')':
-         buffer[pos++] = '\\';
-         buffer[pos++] = ')';
-         break;
-      case '[':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '[';
-         break;
-      case ']':
-         buffer[pos++] = '\\';
-         buffer[pos++] = ']';
-         break;
-      case '+':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '+';
-         break;
-      case '/':
-         buffer[pos++] = '\\';
-         buffer[pos++] = '/';
-         break;
-      case '?': buffer[pos++] = '.'; break;
-      case '*':
-         buffer[pos++] = '.';
-         buffer[pos++] = '*';
-         break;
-      default: buffer[pos++] = *src;
-      }
-      src++;
-   }
-   buffer[pos++] = '\0';
-
-   return std::regex(buffer);
-}
-
-// ------------------------------------------------ calculate-module-dependences
+   int fd{-1};
+   unordered_map<string, int> by_path;
+   unordered_map<int, string> by_wd;
+   bool complete{true}; // false if a watch could not be added
+};
 
-static void calculate_module_dependences(string_view fname,
-                                         string_view modules_dir,
-                                         std::ostream& out)
+// Returns the number of watches added
+static size_t add_watches(Watches& watches, vector<string> paths)
 {
-   static const std::regex import_regex(
-       "^\\s*import\\s+(export\\s+)?([a-zA-Z_][a-zA-Z0-9_\\.]*);");
-   static const std::regex module_regex(
-       "^\\s*module\\s+([a-zA-Z_][a-zA-Z0-9_\\.]*);");
-
-   int counter             = 0;
-   auto process_dependency = [&](const string& module) {
-      if(counter++ > 0) out << " ";
-      out << modules_dir
-          << (modules_dir.size() > 0 and modules_dir.back() != '/' ? "/" : "")
-          << module << ".pcm";
-   };
-
-   std::fstream fin(fname.data());
-   for(string line; std::getline(fin, line);) {
-      std::smatch results;
-      if(std::regex_match(line, results, import_regex)) {
-         process_dependency(results[results.size() - 1].str());
-      } else if(std::regex_match(line, results, module_regex)) {
-         process_dependency(results[results.size() - 1].str());
+   static constexpr uint32_t k_mask
+       = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE
+         | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+         | IN_ONLYDIR;
+
+   std::sort(begin(paths), end(paths));
+   paths.erase(std::unique(begin(paths), end(paths)), end(paths));
+
+   size_t n_added = 0;
+   for(const auto& path : paths) {
+      if(watches.by_path.count(path) > 0) continue;
+      const int wd = inotify_add_watch(watches.fd, path.c_str(), k_mask);
+      if(wd < 0) {
+         watches.complete = false;
+         continue;
       }
+      watches.by_path[path] = wd;
+      watches.by_wd[wd]     = path;
+      ++n_added;
    }
+   return n_added;
 }
 
-// ---------------------------------------------------------- command-substitute
-
-static void command_substitute(State& state,
-                               const string& fname,
-                               const string_view dname,
-                               const FileCommand& cmd,
-                               vector<FilterVariable>& filters)
+// Reads all pending events. Returns TRUE if there were any.
+static bool drain_watches(Watches& watches)
 {
-   // substitute:
-   //    '^' for fname
-   //    '%' for the filename without extension
-   //    '#' same as '%', but without the search directory, and '/' => '.'
-   //    '@' for dirname(fname)
-   //    '&' for basename(fname)
-   // remove all '!', but...
-   // if a '!' exists, then add that product to the list of files in state
-
-   // Remove leading './' if it is there
-   string_view fnamev = fname;
-   if(fnamev.size() > 2 && fnamev[0] == '.' && fnamev[1] == '/')
-      fnamev.remove_prefix(2);
-
-   // Create the extensionless version
-   string_view extlessv = fnamev;
-   {
-      int i = extlessv.size() - 1;
-      for(; i >= 0; --i) {
-         if(extlessv[i] == '.') break;
-         if(extlessv[i] == '/') break;
-      }
-      if(extlessv[i] == '.') extlessv.remove_suffix(extlessv.size() - i);
-   }
-
-   auto strdup = [](string_view s) {
-      auto dup = static_cast<char*>(malloc((s.size() + 1) * sizeof(char)));
-      int pos  = 0;
-      for(auto c : s) dup[pos++] = c;
-      dup[pos] = '\0';
-      return dup;
-   };
-
-   auto write_bname = [&](const char* s, std::ostream& out) {
-      auto dup = strdup(s);
-      out << basename(dup);
-      free(dup);
-   };
-
-   auto write_dir = [&](const char* s, string_view dname, std::ostream& out) {
-      auto dup = strdup(s);
-      out << dirname(dup);
-      free(dup);
-   };
-
-   // Output the command
-   auto process_text = [&](const string& s, std::ostream& out) {
-      unsigned pos = 0;
-      for(auto c : s) {
-         switch(c) {
-         case '^': out << fnamev; break;
-         case '%': out << extlessv; break;
-         case '@': write_dir(fnamev.data(), dname, out); break;
-         case '#':
-            pos = 0;
-            if(extlessv.size() > dname.size()) {
-               pos = dname.size();
-               if(extlessv[pos] == '/') ++pos;
-            }
-            for(auto i = pos; i < extlessv.size(); ++i) {
-               if(extlessv[i] == '/')
-                  out << '.';
-               else
-                  out << extlessv[i];
+   alignas(inotify_event) char buffer[64 * 1024];
+   bool any = false;
+   for(;;) {
+      const auto n = read(watches.fd, buffer, sizeof(buffer));
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return any;
+      any = true;
+      for(auto pos = 0l; pos < n;) {
+         const auto event
+             = reinterpret_cast<const inotify_event*>(buffer + pos);
+         if(event->mask & IN_Q_OVERFLOW) watches.complete = false;
+         if(event->mask & IN_IGNORED) { // the directory is gone
+            auto ii = watches.by_wd.find(event->wd);
+            if(ii != watches.by_wd.end()) {
+               watches.by_path.erase(ii->second);
+               watches.by_wd.erase(ii);
             }
-            break;
-         case '&': write_bname(extlessv.data(), out); break;
-         case '?':
-            calculate_module_dependences(fname, state.opts.module_dir, out);
-         case '!': break;
-         default: out << c;
          }
+         pos += long(sizeof(inotify_event) + event->len);
       }
-   };
-
-   process_text(cmd.command, state.out);
-
-   auto handle_output = [&](const string& s) {
-      for(auto& filter : filters)
-         if(std::regex_match(s.begin(), s.end(), filter.glob))
-            filter.products.push_back(s);
-   };
-
-   // And add in the outputs with '!' on them
-   for(const auto& s : cmd.re_add_outputs) {
-      std::stringstream ss("");
-      process_text(s, ss);
-      auto output = ss.str();
-      handle_output(output);
-      state.additional_filenames.push_back(output);
-      state.additional_dirnames.push_back(empty_directory); //
    }
-
-   for(const auto& s : cmd.other_outputs) {
-      std::stringstream ss("");
-      process_text(s, ss);
-      handle_output(ss.str());
-   }
-
-   state.out << endl;
 }
 
-// --------------------------------------------------------- process-src-command
-
-static void process_src_command(State& state, const vector<string> command)
+// Runs one client's request. The previous output is reused, without even a
+// walk, if the request is identical and nothing watched has changed since.
+static vector<string> serve_request(const vector<string>& request,
+                                    const string& raw_request,
+                                    mobius::Engine& engine,
+                                    Watches& watches,
+                                    bool& changed,
+                                    std::pair<string, string>& memo)
 {
-   // ---- Parse the source line...
-   string cd_dir = "";
-   vector<FilterVariable> filters;
-   vector<string> directories;
-   {
-      vector<string> src_parts;
-      std::istringstream iss(command[0]);
-      std::copy(std::istream_iterator<string>(iss),
-                std::istream_iterator<string>(),
-                std::back_inserter(src_parts));
-      if(src_parts[0] != "+src")
-         throw std::runtime_error("failed to match '+src' in command");
-
-      for(auto i = 1u; i < src_parts.size(); ++i) {
-         auto& part = src_parts[i];
-         auto pos   = part.find('=');
-         if(pos == string::npos) {
-            directories.emplace_back(std::move(part));
-         } else {
-            string var   = part.substr(0, pos);
-            string value = part.substr(pos + 1);
-            if(var == "cd") {
-               if(cd_dir != "")
-                  throw std::runtime_error("multiple 'cd' specifiers");
-               cd_dir = std::move(value);
-            } else {
-               filters.emplace_back();
-               filters.back().variable = std::move(var);
-               filters.back().glob     = make_glob(value);
-               filters.back().filter   = std::move(value);
-            }
-         }
-      }
-   }
-
-   // ---- Parse each of the command lines
-   vector<FileCommand> commands;
-   for(auto i = 1u; i < command.size(); ++i) {
-      if(starts_with(command[i], "~")) {
-         if(commands.size() == 0)
-            throw std::runtime_error("misplaced command extension '~'");
-         auto pos = command[i].find('~');
-         commands.back().command += "\n" + command[i].substr(pos + 1);
-         continue;
-      }
-
-      vector<string> parts;
-      std::istringstream iss(command[i]);
-      std::copy(std::istream_iterator<string>(iss),
-                std::istream_iterator<string>(),
-                std::back_inserter(parts));
-      assert(parts.size() > 0 && parts[0] == "-");
-      if(parts.size() < 2)
-         throw std::runtime_error("failed to match file rule '" + command[i]
-                                  + "'");
-
-      // implode tokens [2..]
-      std::stringstream ss("");
-      for(auto j = 2u; j < parts.size(); ++j) {
-         if(j > 2) ss << " ";
-         ss << parts[j];
-      }
-
-      commands.emplace_back();
-      auto& cmd   = commands.back();
-      cmd.pattern = parts[1];
-      cmd.glob    = make_glob(cmd.pattern);
-      cmd.command = ss.str();
-
-      // Find the outputs (those parts[2..] before the first ':')
-      auto last_output_ind = 0u;
-      for(auto j = 2u; j < parts.size(); ++j) {
-         if(parts[j].back() == ':') {
-            last_output_ind = j + 1; // 1 past the end
-            break;
-         }
-      }
-
-      // Now add those outputs with shebangs to the 're-add' list
-      for(auto j = 2u; j < last_output_ind; ++j) {
-         if(parts[j].back() == ':') parts[j].pop_back();
-         if(parts[j].back() == '!') {
-            parts[j].pop_back();
-            cmd.re_add_outputs.push_back(parts[j]);
-         } else {
-            cmd.other_outputs.push_back(parts[j]);
-         }
+   string cwd;
+   string input;
+   bool has_input = false;
+   vector<string> args{"mobius"};
+   unordered_map<string, string> environment;
+   for(auto i = 0u; i + 1 < request.size(); i += 2) {
+      const auto& key   = request[i];
+      const auto& value = request[i + 1];
+      if(key == "cwd") {
+         cwd = value;
+      } else if(key == "arg") {
+         args.push_back(value);
+      } else if(key == "stdin") {
+         input     = value;
+         has_input = true;
+      } else if(key == "env") {
+         const auto pos = value.find('=');
+         if(pos != string::npos)
+            environment[value.substr(0, pos)] = value.substr(pos + 1);
       }
    }
 
-   // ---- Attempt to change directory
-   if(cd_dir != "") {
-      if(chdir(cd_dir.c_str()) != 0)
-         throw std::runtime_error("failed to change directory to: '" + cd_dir
-                                  + "'");
+   vector<char*> argv;
+   for(auto& arg : args) argv.push_back(&arg[0]);
+   argv.push_back(nullptr);
+
+   char* err_data  = nullptr;
+   size_t err_size = 0;
+   FILE* err       = open_memstream(&err_data, &err_size);
+   if(err == nullptr) return {"status", "1", "stdout", "", "stderr", ""};
+
+   // The client's mistakes are the client's to print
+   auto opts = mobius::parse_commandline(int(args.size()), argv.data(), err);
+   opts.mobius_command = executable_path();
+
+   string output;
+   bool success        = !opts.has_error;
+   bool shards_changed = false;
+   const bool profiling = opts.show_stats || !opts.trace_file.empty()
+                          || !opts.timings_file.empty();
+   const bool reuse     = success && !changed && watches.complete
+                      && !profiling && !opts.shard_output
+                      && opts.diff_file.empty() && !opts.check_modules
+                      && (opts.depfile.empty()
+                          || access(opts.depfile.c_str(), F_OK) == 0)
+                      && memo.first == raw_request;
+
+   if(success && chdir(cwd.c_str()) != 0) {
+      fprintf(err, "failed to change directory to: '%s'\n", cwd.c_str());
+      success = false;
    }
 
-   // ---- Search directories: this is not thread-safe, for what it's worth
-   vector<string> nftw_files;
-   vector<string_view> nftw_dirs;
-   for(const auto& directory : directories) {
-      const auto opts = fs::directory_options::follow_directory_symlink;
-      for(auto& f : fs::recursive_directory_iterator(directory, opts)) {
-         const auto s = f.path().string();
-         if(fs::is_regular_file(s)) {
-            nftw_files.push_back(s);
-            nftw_dirs.push_back(directory);
-         }
+   if(success && reuse) {
+      output = memo.second;
+   } else if(success) {
+      changed = false;
+      mobius::Generation generation(opts);
+      generation.err         = err;
+      generation.input       = has_input ? &input : nullptr;
+      generation.environment = &environment;
+      generation.sink        = [&](string_view s) { output = s; };
+      success                = mobius::generate(&engine, generation);
+      shards_changed         = generation.shards_changed;
+
+      // Only trust the output if the watches were in place for the whole
+      // run, so that no change could have been missed. Files are watched
+      // through their directories.
+      auto paths = std::move(generation.listed_dirs);
+      for(const auto& path : generation.read_files) {
+         const auto pos = path.rfind('/');
+         paths.push_back(path.substr(0, std::max<size_t>(pos, 1)));
       }
+      const auto n_added = add_watches(watches, std::move(paths));
+      if(success && n_added == 0)
+         memo = {raw_request, output};
+      else
+         memo = {};
    }
 
-   // ---- Move back to original CWD if we changed directory
-   if(cd_dir != "")
-      if(chdir(state.current_working_directory.c_str()) != 0)
-         throw std::runtime_error("failed to change directory to: '"
-                                  + state.current_working_directory + "'");
-
-   // ---- Match and substitude files against the commands
-   auto match_and_substitute
-       = [&](const string& fname, string_view dname, const FileCommand& cmd) {
-            if(std::regex_match(fname.begin(), fname.end(), cmd.glob)) {
-               // Parse the command and add
-               command_substitute(state, fname, dname, cmd, filters);
-
-               // We may filter the input file as well...
-               for(auto& filter : filters)
-                  if(std::regex_match(fname.begin(), fname.end(), filter.glob))
-                     filter.products.push_back(fname);
-
-               return true;
-            }
-            return false;
-         };
-
-   while(nftw_files.size() > 0) {
-      for(auto i = 0u; i < nftw_files.size(); ++i) {
-         const auto& fname = nftw_files[i];
-         const auto& dname = nftw_dirs[i];
-         for(const auto& cmd : commands) {
-            if(match_and_substitute(fname, dname, cmd)) break;
-         }
+   // Deliver the output
+   const bool to_stdout = (opts.out_file == "-" || opts.out_file == "");
+   if(success && !to_stdout) {
+      try {
+         if(!mobius::write_file_if_changed(opts.out_file, output)
+            && !opts.depfile.empty() && shards_changed)
+            mobius::touch_file(opts.out_file);
+      } catch(std::exception& e) {
+         fprintf(err, "%s\n", e.what());
+         success = false;
       }
-      nftw_files = state.additional_filenames;
-      nftw_dirs  = state.additional_dirnames;
-      state.additional_filenames.clear();
-      state.additional_dirnames.clear();
+      output.clear();
    }
 
-   // ---- Ensure that environment variables exist for all filters
-   for(auto& filter : filters) {
-      auto ii = state.env.find(filter.variable);
-      if(ii == cend(state.env)) state.env[filter.variable] = string{};
-   }
+   fclose(err);
+   string messages(err_data, err_size);
+   free(err_data);
+   return {"status",
+           success ? "0" : "1",
+           "stdout",
+           std::move(output),
+           "stderr",
+           std::move(messages)};
+}
 
-   // ---- Now update any environment variables (via filter products)
-   const string main_cpp = "main.cpp"s;
-   const string main_cc  = "main.cc"s;
+static constexpr time_t k_client_timeout_s = 10;
 
-   auto is_main_source_file = [&](const auto& fname) -> bool {
-      return ends_with(fname, main_cpp) || ends_with(fname, main_cc)
-             || ends_with(fname, "main.cxx"s) || ends_with(fname, "main.c"s);
-   };
+static bool serve(const Options& opts)
+{
+   signal(SIGPIPE, SIG_IGN);
+
+   const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   const auto addr = make_socket_address(opts.serve_socket);
+   unlink(opts.serve_socket.c_str());
+   if(sock < 0
+      || bind(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))
+             != 0
+      || listen(sock, 16) != 0) {
+      fprintf(stderr,
+              "failed to listen on '%s': %s\n",
+              opts.serve_socket.c_str(),
+              strerror(errno));
+      return false;
+   }
 
-   for(auto& filter : filters) {
-      if(!filter.products.empty()) {
-         auto ii = state.env.find(filter.variable);
-         std::stringstream ss("");
-         bool first = true; // do we place a space...
+   Watches watches;
+   watches.fd       = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+   watches.complete = (watches.fd >= 0);
 
-         if(ii != state.env.end()) {
-            ss << ii->second;
-            first = false;
-         }
+   mobius::Engine engine;
+   std::pair<string, string> memo; // the last request, and its output
+   bool changed = true;
 
-         // sort the filter, such that any `main.cpp` files come first
-         std::sort(filter.products.begin(),
-                   filter.products.end(),
-                   [&](const auto& A, const auto& B) {
-                      const bool a_ends = is_main_source_file(A);
-                      const bool b_ends = is_main_source_file(B);
-                      if(a_ends && !b_ends) return true;
-                      if(!a_ends && b_ends) return false;
-                      return A < B;
-                   });
-
-         for(const auto& s : filter.products) {
-            if(first)
-               first = false;
-            else
-               ss << ' ';
-            ss << s;
-         }
+   for(;;) {
+      pollfd fds[2] = {{sock, POLLIN, 0}, {watches.fd, POLLIN, 0}};
+      if(poll(fds, watches.fd >= 0 ? 2 : 1, -1) < 0) {
+         if(errno == EINTR) continue;
+         fprintf(stderr, "poll failed: %s\n", strerror(errno));
+         return false;
+      }
 
-         state.env[filter.variable] = ss.str();
-         filter.products.clear();
+      if(watches.fd >= 0 && (fds[1].revents & POLLIN))
+         if(drain_watches(watches)) changed = true;
+
+      if(fds[0].revents & POLLIN) {
+         const int client = accept4(sock, nullptr, nullptr, SOCK_CLOEXEC);
+         if(client < 0) continue;
+
+         // Catch changes made just before the request
+         if(watches.fd >= 0 && drain_watches(watches)) changed = true;
+
+         // A client that stalls is dropped, rather than stalling the daemon
+         const timeval timeout{k_client_timeout_s, 0};
+         setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+         setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+         vector<string> request;
+         string raw_request;
+         try {
+            if(recv_message(
+                   client, request, &raw_request, k_max_request_bytes))
+               send_message(client,
+                            serve_request(request,
+                                          raw_request,
+                                          engine,
+                                          watches,
+                                          changed,
+                                          memo));
+         } catch(std::exception& e) {
+            fprintf(stderr, "failed to serve a request: %s\n", e.what());
+         }
+         close(client);
       }
    }
 }
 
-// ------------------------------------------------------------------ preprocess
+// ---------------------------------------------------------------------- client
 
-static bool preprocess_input(State& state)
+// Sends the command line to a daemon, and writes out what it sends back.
+// Returns FALSE if there's no daemon to talk to.
+static bool run_client(const Options& opts, int argc, char** argv, int& status)
 {
-   for(string line; std::getline(state.in, line);) {
-      if(!starts_with(line, "#")) substitute_env_variables(state, line, false);
-      state.lines.push_back(line);
+   const int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   const auto addr = make_socket_address(opts.connect_socket);
+   if(sock < 0
+      || connect(sock, reinterpret_cast<const sockaddr*>(&addr), sizeof(addr))
+             != 0) {
+      if(sock >= 0) close(sock);
+      return false;
    }
-   return true;
-}
-
-// ----------------------------------------------------------------- process+src
-
-static bool process_source_commands(State& state)
-{
-   vector<string> src_command;
-   for(auto& line : state.lines) {
-      // Skip comments
-      if(starts_with(line, "#")) {
-         state.out << line << std::endl;
-         continue;
-      }
-
-      if(src_command.size() > 0      // we're in a command
-         && !starts_with(line, "~")  // not adding to previous command
-         && !starts_with(line, "-")) // not adding to a command
-      {
-         process_src_command(state, src_command);
-         src_command.clear();
-      }
-
-      // Final "strict" substitution of environment variables
-      substitute_env_variables(state, line, true);
-
-      // Process the line
-      if(starts_with(line, "+src")) {
-         assert(src_command.size() == 0);
-         src_command.push_back(line);
 
-      } else if(src_command.size() > 0
-                && (starts_with(line, "-") || starts_with(line, "~"))) {
-         src_command.push_back(line);
-
-      } else {
-         state.out << line << std::endl;
-      }
+   vector<string> request;
+   auto cwd = getcwd(nullptr, 0);
+   request.insert(end(request), {"cwd", cwd});
+   free(cwd);
+   for(int i = 1; i < argc; ++i) request.insert(end(request), {"arg", argv[i]});
+   for(auto env = environ; *env != nullptr; ++env)
+      request.insert(end(request), {"env", *env});
+   if(opts.in_file == "-") {
+      string input((std::istreambuf_iterator<char>(std::cin)),
+                   std::istreambuf_iterator<char>());
+      request.insert(end(request), {"stdin", std::move(input)});
    }
 
-   if(src_command.size() > 0) {
-      process_src_command(state, src_command);
-      src_command.clear();
+   vector<string> response;
+   const bool success = send_message(sock, request)
+                        && recv_message(sock, response, nullptr, k_no_limit);
+   close(sock);
+   if(!success) {
+      fprintf(stderr, "lost connection to '%s'\n", opts.connect_socket.c_str());
+      status = EXIT_FAILURE;
+      return true;
    }
 
-   return true;
-}
-
-// ------------------------------------------------------------- transform input
-
-static bool transform_input(State& state)
-{
-   preprocess_input(state);
-   process_source_commands(state);
+   status = EXIT_FAILURE;
+   for(auto i = 0u; i + 1 < response.size(); i += 2) {
+      const auto& key   = response[i];
+      const auto& value = response[i + 1];
+      if(key == "status")
+         status = (value == "0") ? EXIT_SUCCESS : EXIT_FAILURE;
+      else if(key == "stdout")
+         fwrite(value.data(), 1, value.size(), stdout);
+      else if(key == "stderr")
+         fwrite(value.data(), 1, value.size(), stderr);
+   }
    return true;
 }
@@ -0,0 +1,5881 @@
+// Copyright (c) 2018, Aaron Michaux
+// All rights reserved.
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <cctype>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "mobius.hpp"
+
+using std::cout;
+using std::endl;
+using std::ostream;
+using std::string;
+using std::string_view;
+using std::unordered_map;
+using std::vector;
+
+using namespace std::string_literals;
+using namespace std::string_view_literals;
+
+namespace mobius
+{
+// ------------------------------------------------------------------ structures
+
+// Enough of a 'struct stat' to tell if a file or directory has changed
+struct FileStamp
+{
+   uint64_t dev{0};
+   uint64_t ino{0};
+   uint64_t size{0};
+   int64_t mtime_sec{0};
+   int64_t mtime_nsec{0};
+   int64_t ctime_sec{0};
+   int64_t ctime_nsec{0};
+};
+
+// Persisted between runs (-c <filename>)
+struct ScanCache
+{
+   // A directory listing, keyed by (dev, inode), and valid while the
+   // directory's stamp is unchanged.
+   struct Dir
+   {
+      FileStamp stamp;
+      vector<std::pair<string, bool>> entries; // (name, is-directory)
+      bool used{false};
+   };
+
+   // The output of a +src block, keyed by a hash of everything that went
+   // into it, and valid while the files scanned for '?' are unchanged.
+   struct Block
+   {
+      vector<std::pair<string, FileStamp>> inputs;
+      size_t n_scanned{0}; // inputs scanned for '?'; the unity files follow
+      string output;
+      vector<std::pair<string, string>> variables; // filter variables
+      bool used{false};
+   };
+
+   // The modules that a source file provides and requires (for '?'), keyed
+   // by path, and valid while the file's stamp is unchanged. Doubles as
+   // the in-process memo, so a file is never read twice in one run.
+   // Partitions are named 'module:partition'.
+   struct Module
+   {
+      FileStamp stamp;
+      vector<string> provided;     // 'export module m;', 'module m:part;'
+      vector<string> required;     // 'import m;', 'import :part;', 'module m;'
+      vector<string> header_units; // 'import <vector>;', 'import "x.h";'
+      bool is_module_unit{false};  // has a module declaration
+      bool used{false};    // validated during this run
+      bool settled{true}; // safe to persist
+   };
+
+   unordered_map<uint64_t, Dir> dirs;
+   unordered_map<uint64_t, Block> blocks;
+   unordered_map<string, Module> modules;
+
+   // Work done this run, by any thread
+   std::atomic<uint64_t> n_files_scanned{0};
+   std::atomic<uint64_t> n_bytes_scanned{0};
+};
+
+// Several configurations (--config) of one run share a walk and scan. The
+// first configuration records the files that each +src block found, and
+// fills 'cache'; then the others run in parallel, reading (never writing)
+// both.
+struct SharedScan
+{
+   struct Walk
+   {
+      vector<string> roots;
+      vector<string> files;
+      vector<uint32_t> file_roots; // index into 'roots', for each file
+      vector<string> listed;       // directories
+      vector<string> read;         // ignore files, and git indexes
+   };
+
+   ScanCache cache; // from -c; entries marked 'used' are valid this run
+   unordered_map<uint64_t, Walk> walks; // by a hash of how they were found
+   unordered_map<uint64_t, ScanCache::Block> blocks; // settled or not
+   bool recording{true}; // false once the first configuration is done
+};
+
+// Where the time goes (--timings, --stats and --trace). Time is charged to
+// phases: each moment to exactly one of them, the innermost one running.
+struct Profile
+{
+   using clock = std::chrono::steady_clock;
+
+   enum Phase : int {
+      OTHER,      // reading input, expanding variables, the scan cache
+      WALK,       // listing directories
+      MATCH,      // matching files against rules
+      SUBSTITUTE, // expanding rule templates
+      SCAN,       // scanning files for '?'
+      FILTER,     // joining filter variables
+      OUTPUT,     // writing the output
+      N_PHASES
+   };
+
+   struct Block
+   {
+      string name; // the +src line
+      double start{0.0};
+      double seconds{0.0};
+      double cpu_seconds{0.0};
+      uint64_t n_files{0};
+      bool from_cache{false};
+      vector<std::pair<string, uint64_t>> rule_matches; // pattern, count
+   };
+
+   // A Chrome trace 'complete' event
+   struct TraceEvent
+   {
+      string name;
+      const char* category{""};
+      double start{0.0};
+      double duration{0.0};
+   };
+
+   bool tracing{false};
+   clock::time_point start{clock::now()};
+   Phase phase{OTHER};
+   double since{0.0};     // seconds from 'start'
+   double since_cpu{0.0}; // process cpu seconds
+   double seconds[N_PHASES]     = {};
+   double cpu_seconds[N_PHASES] = {};
+
+   vector<Block> blocks;
+   vector<TraceEvent> events;
+
+   uint64_t n_files_visited{0};
+   uint64_t n_glob_evaluations{0};
+   uint64_t n_regex_evaluations{0};
+   uint64_t n_files_scanned{0};
+   uint64_t n_bytes_scanned{0};
+   uint64_t n_bytes_written{0};
+};
+
+// Charges the time until it is destroyed to 'phase', and records it as a
+// trace event if 'traced'. Does nothing if 'profile' is null.
+struct PhaseTimer
+{
+   PhaseTimer(Profile* profile_, Profile::Phase phase, bool traced = true);
+   PhaseTimer(const PhaseTimer&) = delete;
+   PhaseTimer& operator=(const PhaseTimer&) = delete;
+   ~PhaseTimer();
+
+   Profile* profile{nullptr};
+   Profile::Phase phase{Profile::OTHER};
+   Profile::Phase previous{Profile::OTHER};
+   bool traced{true};
+   double start{0.0};
+};
+
+// Replaces 'filename' atomically, and only if its contents change, so that
+// its mtime (which ninja watches) is left alone when nothing changed. The
+// output is compared, chunk by chunk, with the existing file, and nothing
+// is written until the first difference.
+struct WriteIfChanged
+{
+   WriteIfChanged() = default;
+   WriteIfChanged(const WriteIfChanged&) = delete;
+   WriteIfChanged& operator=(const WriteIfChanged&) = delete;
+   ~WriteIfChanged();
+
+   string filename;
+   string tmp_filename;
+   int fd{-1};                    // the temporary file, once opened
+   const char* old_data{nullptr}; // the existing file, mmapped
+   size_t old_size{0};
+   bool old_exists{false};
+   size_t offset{0}; // bytes of output so far
+};
+
+// Builds output in one large buffer that is reused. If 'fd' or 'file' is
+// set, then the buffer is written out in big chunks as it fills; otherwise
+// it simply accumulates, like a string builder.
+struct OutputBuffer
+{
+   static constexpr size_t k_chunk_size = 1 << 20;
+
+   OutputBuffer() = default;
+   explicit OutputBuffer(int fd_)
+       : fd(fd_)
+   {
+      buffer.reserve(k_chunk_size + 64 * 1024);
+   }
+   explicit OutputBuffer(WriteIfChanged& file_)
+       : file(&file_)
+   {
+      buffer.reserve(k_chunk_size + 64 * 1024);
+   }
+   OutputBuffer(const OutputBuffer&) = delete;
+   OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+   int fd{-1};
+   WriteIfChanged* file{nullptr};
+   Profile* profile{nullptr}; // charges writes to Profile::OUTPUT
+   string buffer;
+};
+
+// The output of one +src block, with --shard
+struct Shard
+{
+   WriteIfChanged file;
+   OutputBuffer out{file};
+};
+
+// Reads the input a line at a time. Regular files are mmapped; anything
+// else (like stdin) is read in large blocks. Each line is a view, which is
+// valid until the next line is read.
+struct InputReader
+{
+   static constexpr size_t k_block_size = 1 << 20;
+
+   InputReader() = default;
+   InputReader(const InputReader&) = delete;
+   InputReader& operator=(const InputReader&) = delete;
+   ~InputReader();
+
+   int fd{-1};
+   bool owns_fd{false};
+   bool mapped{false};
+   const char* data{nullptr}; // the mmapped file
+   size_t size{0};
+   size_t pos{0};     // the start of the next line
+   string block;      // when not mmapped, the unread input
+   size_t scanned{0}; // 'block' has no newlines before this
+   bool eof{false};
+};
+
+// A piece of a line: literal text, or a variable reference
+struct LineSegment
+{
+   enum Kind : uint8_t {
+      LITERAL,  // 'text'
+      VARIABLE, // '${text}'
+      DEFAULT,  // '${text:-word}', 'word' if the variable is unset or empty
+      REQUIRED  // '${text:?word}', an error if the variable is unset or empty
+   };
+
+   Kind kind{LITERAL};
+   string_view text;
+   string_view word;
+};
+
+// Paths, each stored once in an arena, as (parent directory, name) entries.
+// A +src block passes its paths around as ids into the table.
+struct PathTable
+{
+   using Id                             = uint32_t;
+   static constexpr Id k_none           = std::numeric_limits<Id>::max();
+   static constexpr size_t k_chunk_size = 1 << 20;
+
+   struct Entry
+   {
+      const char* path{nullptr}; // the whole path, in the arena
+      uint32_t size{0};
+      uint32_t name_pos{0}; // the start of the last component
+      Id parent{k_none};    // its directory, if it was walked
+      Id root{k_none};      // the search directory it was found in
+   };
+
+   vector<Entry> entries;
+   vector<std::unique_ptr<char[]>> chunks; // the arena, which never moves
+   size_t chunk_used{0};                   // of the last chunk
+   size_t chunk_size{0};
+};
+
+struct State
+{
+   State(const Options& opts_, InputReader& in_, OutputBuffer& out_)
+       : opts(opts_)
+       , in(in_)
+       , out(out_)
+   {
+      auto cwd                  = getcwd(nullptr, 0);
+      current_working_directory = cwd;
+      free(cwd);
+
+      // for stdin, stdout, stderr
+      n_descriptors = sysconf(_SC_OPEN_MAX) - 3;
+
+      env.insert(opts.defines.begin(), opts.defines.end());
+   }
+
+   bool has_error{false};
+
+   const Options& opts;
+   FILE* err{stderr}; // for messages
+   InputReader& in;
+   OutputBuffer& out;
+   OutputBuffer scratch; // reused for building output filenames
+   OutputBuffer line_scratch; // reused for substituting variables
+   vector<LineSegment> line_segments; // reused for parsing variables
+   unordered_map<string_view, const string*> variables; // memo, into 'env'
+   string current_working_directory{""};
+   PathTable paths;                      // of the current +src block
+   vector<PathTable::Id> additional_files; // products with a '!'
+   unordered_map<string, string> env; // cached environment variables
+   ScanCache cache;
+   vector<string> scanned_files; // read for '?' by the current +src block
+   std::unordered_set<string> scanned_set; // 'scanned_files', to find them
+   vector<string> module_files;  // by every +src block, with --check-modules
+   vector<string_view> unity_sources; // for '?', of the unity file substituted
+   string cd_dir;                // of the current +src block
+   string dyndep_prefix;         // of the current +src block, with --dyndep
+   vector<string> dyndep_scans;  // P1689 files of the current +src block
+   Profile* profile{nullptr};    // set with --timings, --stats or --trace
+   bool caching{false};          // use 'cache' for listings and blocks
+   SharedScan* shared{nullptr};  // with other configurations (--config)
+
+   // The client's environment, when serving; otherwise getenv(3) is used
+   const unordered_map<string, string>* environment{nullptr};
+
+   // What the output depends on, as absolute paths, if 'track_inputs'
+   bool track_inputs{false};
+   vector<string> listed_dirs; // every directory walked
+   vector<string> read_files;  // every file scanned for '?', or ignore file read
+
+   // Variables read from the environment (not -D), with the values read
+   vector<std::pair<string, string>> env_reads;
+
+   bool cache_resident{false}; // a lent cache (see Run), instead of -c
+   vector<std::unique_ptr<Shard>> shards; // committed once all is done
+   bool shards_changed{false}; // some shard was rewritten
+   bool dyndep_rules_written{false};
+
+   int n_descriptors{0};
+   unsigned n_src_blocks{0};
+};
+
+// Lends an engine's in-memory scan cache to a run, for the lifetime of the
+// loan. Does nothing if 'resident' is null.
+struct ResidentCacheLoan
+{
+   ResidentCacheLoan(ScanCache* resident_, ScanCache& cache_);
+   ResidentCacheLoan(const ResidentCacheLoan&) = delete;
+   ResidentCacheLoan& operator=(const ResidentCacheLoan&) = delete;
+   ~ResidentCacheLoan();
+
+   ScanCache* resident{nullptr};
+   ScanCache& cache;
+};
+
+// One run of mobius: a generation (see generate), or one of its
+// configurations (--config)
+struct Run
+{
+   explicit Run(const Options& opts_)
+       : opts(opts_)
+   {}
+
+   const Options& opts;
+   FILE* err{stderr}; // for messages
+
+   // Set for an engine's generation, or one of several configurations
+   ScanCache* resident{nullptr}; // kept in memory between runs
+   SharedScan* shared{nullptr};  // with the other configurations
+   const string* input{nullptr}; // instead of 'opts.in_file'
+   const unordered_map<string, string>* environment{nullptr};
+   string* captured{nullptr}; // takes the output, instead of writing it
+   vector<string> listed_dirs; // what the output depends on, with 'resident'
+   vector<string> read_files;
+   bool shards_changed{false};
+};
+
+struct GlobToken
+{
+   enum Type : uint8_t {
+      LITERAL,    // 'literal' must match exactly
+      ANY_CHAR,   // '?'
+      CHAR_CLASS, // '[a-z]', '[!a-z]'
+      STAR,       // '*', matches anything, including '/'
+      GLOBSTAR    // '**/', matches zero or more whole directories
+   };
+
+   Type type{LITERAL};
+   string literal;
+   std::bitset<256> char_class;
+};
+
+struct Glob
+{
+   enum Kind : uint8_t {
+      EXACT,         // 'literal'
+      PREFIX,        // 'prefix*'
+      SUFFIX,        // '*suffix'
+      PREFIX_SUFFIX, // 'prefix*suffix'
+      GENERAL,       // 'prefix' tokens... 'suffix'
+      REGEX          // std::regex fallback (--regex-globs)
+   };
+
+   Kind kind{EXACT};
+   string pattern;
+   string prefix; // literal text before the first wildcard
+   string suffix; // literal text after the last wildcard
+   vector<GlobToken> tokens; // everything between 'prefix' and 'suffix'
+   std::regex regex;
+};
+
+// Finds the globs (of many) that match a filename, in about one pass over
+// the filename. Globs that can only match one extension (i.e., '*.cpp') are
+// bucketed by that extension, and only globs in the filename's bucket (plus
+// any that could not be bucketed) are tried, in their original order.
+struct GlobIndex
+{
+   vector<const Glob*> globs;
+   unordered_map<string, vector<uint32_t>> by_extension;
+   vector<uint32_t> unbucketed;
+
+   // Globs matched against, for --stats
+   mutable uint64_t n_evaluations{0};
+   mutable uint64_t n_regex_evaluations{0};
+};
+
+// A command (or output) compiled into literal text and substitutions
+struct CommandChunk
+{
+   enum Kind : int {
+      LITERAL,  // 'text'
+      FILENAME, // '^'
+      EXTLESS,  // '%'
+      DIRNAME,  // '@'
+      DOTTED,   // '#'
+      BASENAME, // '&'
+      MODULES   // '?'
+   };
+
+   Kind kind{LITERAL};
+   string text;
+};
+
+using CommandTemplate = vector<CommandChunk>;
+
+struct FileCommand
+{
+   string pattern;
+   Glob glob;
+   string command;
+   vector<string> re_add_outputs;
+   vector<string> other_outputs;
+   bool scans_modules{false}; // uses '?'
+   string primary_output;     // the first output of a build statement
+
+   CommandTemplate command_template;
+   vector<CommandTemplate> re_add_templates;
+   vector<CommandTemplate> other_templates;
+
+   // With --dyndep, the build statement's first line, and the rest, so
+   // that the dyndep file can be added in between
+   CommandTemplate head_template;
+   CommandTemplate tail_template;
+   CommandTemplate primary_template;
+};
+
+// A parsed JSON value; enough to read P1689 module dependency files
+struct JsonValue
+{
+   enum Type : uint8_t { NUL, BOOLEAN, NUMBER, STRING, ARRAY, OBJECT };
+
+   Type type{NUL};
+   bool boolean{false};
+   double number{0.0};
+   string str;
+   vector<JsonValue> array;
+   vector<std::pair<string, JsonValue>> object;
+};
+
+struct FilterVariable
+{
+   string variable;
+   string filter;
+   Glob glob;
+   vector<PathTable::Id> products;
+};
+
+// What a +src block's walk skips, so that it never lists those directories
+struct WalkFilter
+{
+   vector<Glob> excludes;       // 'exclude=<glob>', for files and directories
+   vector<string> ignore_files; // 'ignore=<filename>', i.e., '.gitignore'
+   vector<string> rule_prefixes; // the literal prefix of each rule's pattern
+   bool prune_by_rules{false};   // no rule can match outside its prefix
+};
+
+// A +src block's 'unity=<n>' options
+struct UnityOptions
+{
+   unsigned size{0};    // sources per unity file; 0 => no unity build
+   bool by_dir{false};  // 'unity_by=dir': batch each directory apart
+   string dir{"unity"}; // 'unity_dir=<dirname>', for the unity files
+};
+
+// Sources that one rule compiles together, through a generated unity file
+// that includes each of them
+struct UnityBatch
+{
+   string filename; // of the unity file, as rules see it
+   int command{-1};
+   vector<PathTable::Id> sources;
+};
+
+// A build statement of a ninja manifest, evaluated, as --diff compares them
+struct NinjaEdge
+{
+   string rule;
+   vector<string> outputs;
+   vector<string> implicit_outputs; // after '|'
+   vector<string> inputs;
+   vector<string> implicit_inputs; // after '|'
+   vector<string> order_only;      // after '||'
+   vector<string> validations;     // after '|@'
+   vector<std::pair<string, string>> bindings; // the edge's own, sorted
+   string command;                             // as the rule runs it
+};
+
+// The build statements and rules of a manifest (and what it includes)
+struct NinjaManifest
+{
+   unordered_map<string, NinjaEdge> edges; // by first output
+   unordered_map<string, vector<std::pair<string, string>>> rules; // raw
+};
+
+// -------------------------------------------------------------- predefinitions
+
+// Environment variables
+// Splits 'line' into literal text and variable references, in one pass
+static void parse_line_segments(string_view line,
+                                vector<LineSegment>& segments);
+
+// Writes 'line', with its variables expanded, to 'out'
+static void expand_variables(State& state, string_view line, OutputBuffer& out);
+
+// Returns 'line' with its variables expanded, which may be a view of
+// 'state.line_scratch'.
+static string_view substitute_env_variables(State& state, string_view line);
+
+// Input
+static bool open_input(InputReader& in, const string& filename);
+static void open_input_string(InputReader& in, const string& data);
+static bool read_line(InputReader& in, string_view& line);
+
+// Output
+static OutputBuffer& operator<<(OutputBuffer& out, string_view s);
+static OutputBuffer& operator<<(OutputBuffer& out, char c);
+static void flush_output(OutputBuffer& out);
+
+// Profiling
+static double profile_clock(const Profile& profile);
+static void switch_phase(Profile& profile, Profile::Phase phase);
+static void finish_profile(Profile& profile);
+static void save_timings(const Profile& profile, const string& filename);
+static void save_trace(const Profile& profile, const string& filename);
+static void print_stats(const Profile& profile, FILE* fp);
+
+// Write-if-changed files
+static void open_write_if_changed(WriteIfChanged& file, const string& filename);
+static void write_if_changed(WriteIfChanged& file, string_view data);
+static bool commit_write_if_changed(WriteIfChanged& file);
+
+// Shards (--shard), committed once the whole output is
+static void commit_shards(State& state);
+
+// Regeneration (--depfile)
+static void write_regenerate_edge(State& state);
+static void save_depfile(const State& state);
+
+// String functions
+static bool starts_with(string_view s, string_view prefix);
+static void ltrim(std::string& s);
+static void rtrim(std::string& s);
+static void trim(std::string& s);
+static bool is_empty_line(const std::string& s);
+
+// Turns a glob pattern into a regex.
+static std::regex make_regex_glob(const string& pattern);
+
+// Compiles a glob pattern, using std::regex only if 'use_regex' is set.
+static Glob make_glob(const string& pattern, bool use_regex);
+static bool glob_match(const Glob& glob, string_view s);
+
+// Indexes a set of globs, which must outlive the index.
+static GlobIndex make_glob_index(vector<const Glob*> globs);
+static int glob_index_first_match(const GlobIndex& index, string_view s);
+
+// Compiles the substitution characters in a command
+static CommandTemplate compile_command_template(const string& s);
+
+// Paths in the table
+static void clear_path_table(PathTable& table);
+static PathTable::Id intern_path(PathTable& table,
+                                 string_view path,
+                                 PathTable::Id parent = PathTable::k_none,
+                                 PathTable::Id root   = PathTable::k_none);
+static PathTable::Id
+intern_child(PathTable& table, PathTable::Id parent, string_view name);
+static string_view path_view(const PathTable& table, PathTable::Id id);
+
+// Runs an individual matched substitution
+static void command_substitute(State& state,
+                               OutputBuffer& out,
+                               string_view fname,
+                               const string_view dname,
+                               const FileCommand& cmd,
+                               vector<FilterVariable>& filters,
+                               const GlobIndex& filter_index);
+
+// Recursively lists the regular files in 'roots' (which are relative to the
+// 'base' directory, if it isn't empty), in a canonical order, interning them
+// (and their directories, and roots, as given) into 'paths'. Whatever
+// 'filter' skips is never descended into, and a directory reached twice
+// (i.e., through a symlink) is only walked where it comes first.
+// Directory listings are taken from (and saved to) 'cache', if it is not
+// null. Every directory listed is added to 'listed', and every ignore file
+// read to 'read', if they are not null, as paths that include 'base'.
+static void walk_directories(string_view base,
+                             const vector<string>& roots,
+                             const WalkFilter& filter,
+                             unsigned n_threads,
+                             ScanCache* cache,
+                             PathTable& paths,
+                             vector<PathTable::Id>& files,
+                             vector<string>* listed,
+                             vector<string>* read);
+
+// Lists the regular files that git tracks in 'roots' from the index of the
+// enclosing repository, in the same order as walk_directories, and only
+// skipping what 'filter' excludes. Untracked files that git doesn't ignore
+// are walked, and merged in, if 'untracked' is set. The index file is
+// added to 'read', if it is not null.
+static void list_git_files(string_view base,
+                           const vector<string>& roots,
+                           const WalkFilter& filter,
+                           bool untracked,
+                           unsigned n_threads,
+                           ScanCache* cache,
+                           PathTable& paths,
+                           vector<PathTable::Id>& files,
+                           vector<string>* listed,
+                           vector<string>* read);
+
+// Scan cache
+static void load_scan_cache(ScanCache& cache, const string& filename, FILE* err);
+static void swap_scan_caches(ScanCache& a, ScanCache& b);
+static void
+save_scan_cache(const ScanCache& cache, const string& filename, FILE* err);
+
+// What the first of several configurations (--config) found, for the rest
+static const SharedScan::Walk* find_shared_walk(const State& state,
+                                                uint64_t key);
+static void record_walk(SharedScan& shared,
+                        uint64_t key,
+                        const vector<string>& roots,
+                        const PathTable& paths,
+                        const vector<PathTable::Id>& files,
+                        const vector<string>& listed,
+                        const vector<string>& read);
+static void replay_walk(const SharedScan::Walk& walk,
+                        PathTable& paths,
+                        vector<PathTable::Id>& files);
+static const ScanCache::Block* find_shared_block(const State& state,
+                                                 uint64_t key);
+static const ScanCache::Module* find_shared_module(const State& state,
+                                                   const string& path);
+
+// Unity builds ('unity=<n>'), through generated files that include sources
+static vector<UnityBatch> make_unity_batches(State& state,
+                                             const UnityOptions& unity,
+                                             unsigned block,
+                                             const vector<FileCommand>& commands,
+                                             const vector<PathTable::Id>& files,
+                                             const vector<int>& matches,
+                                             vector<int>& batch_of);
+static string write_unity_file(State& state,
+                               const UnityOptions& unity,
+                               const UnityBatch& batch);
+static void make_directories(const string& dname);
+
+// Sets each filter's variable to the files that matched it
+static void join_filter_products(State& state, vector<FilterVariable>& filters);
+
+// A path relative to the working directory, made absolute
+static string absolute_path(const State& state, const string& path);
+
+// The modules that 'fname' provides and requires, scanned (or memoized)
+static const ScanCache::Module& source_module(State& state, string_view fname);
+
+// Checks the modules of every file scanned for '?' (--check-modules)
+static void check_modules(State& state);
+
+// Runs an entire +src command
+static void process_src_command(State& state, const vector<string> command);
+
+// The actual pipeline
+static bool transform_input(State& state);
+static bool run_mobius(Run& run);
+
+// Several configurations (--config), from one walk and scan
+static string config_filename(const string& filename, const string& name);
+static void merge_scan_caches(ScanCache& into, ScanCache& from);
+static bool run_configurations(Run& run);
+
+// Ninja manifests, and how they differ (--diff)
+static void parse_ninja_manifest(string_view text,
+                                 unordered_map<string, string>& scope,
+                                 NinjaManifest& manifest,
+                                 unsigned depth);
+static void read_ninja_manifest(const string& filename,
+                                NinjaManifest& manifest);
+static void print_manifest_diff(FILE* fp,
+                                const string& old_name,
+                                const NinjaManifest& old_manifest,
+                                const NinjaManifest& new_manifest);
+
+// Build-time module dependences, for ninja's dyndep (--dyndep)
+static JsonValue parse_json(string_view text);
+static void write_dyndep_rules(State& state);
+using Sink = std::function<void(string_view)>;
+static void write_result(const string& filename,
+                         string_view contents,
+                         const Sink& sink = nullptr);
+
+// ---------------------------------------------------------- parse command-line
+
+Options parse_commandline(int argc, char** argv, FILE* err)
+{
+   Options opts;
+
+   auto safe_s = [&](int& ind) -> string {
+      ++ind;
+      if(ind >= argc) {
+         fprintf(err, "Expected argument after '%s'.\n", argv[ind]);
+         opts.has_error = true;
+         return "";
+      }
+      return argv[ind];
+   };
+
+   auto process_define = [&](const string& s, auto& defines) {
+      auto pos = s.find('=');
+      if(pos == string::npos)
+         defines[s] = "";
+      else
+         defines[s.substr(0, pos)] = s.substr(pos + 1);
+   };
+
+   // '--config name:-Dvar=value', where a repeated name adds to the set
+   auto process_config = [&](const string& s) {
+      const auto pos  = s.find(':');
+      const auto name = s.substr(0, pos);
+      if(name.empty()) {
+         fprintf(err, "Expected a name in '--config %s'.\n", s.c_str());
+         opts.has_error = true;
+         return;
+      }
+      auto ii = std::find_if(begin(opts.configs),
+                             end(opts.configs),
+                             [&](const auto& o) { return o.first == name; });
+      if(ii == end(opts.configs))
+         ii = opts.configs.insert(ii, {name, {}});
+      if(pos == string::npos) return;
+      const auto define = s.substr(pos + 1);
+      process_define(starts_with(define, "-D") ? define.substr(2) : define,
+                     ii->second);
+   };
+
+   for(int i = 1; i < argc && !opts.has_error; ++i) {
+      string arg = argv[i];
+      if(arg == "-h" || arg == "--help") {
+         opts.show_help = true;
+      } else if(arg == "-i") {
+         opts.in_file = safe_s(i);
+      } else if(arg == "-") {
+         opts.in_file = arg;
+      } else if(arg == "-o") {
+         opts.out_file = safe_s(i);
+      } else if(arg == "-m") {
+         opts.module_dir = safe_s(i);
+      } else if(arg == "-c") {
+         opts.cache_file = safe_s(i);
+      } else if(arg == "-j") {
+         opts.n_threads = unsigned(std::max(0, atoi(safe_s(i).c_str())));
+      } else if(starts_with(arg, "-j")) {
+         opts.n_threads = unsigned(std::max(0, atoi(&arg[2])));
+      } else if(arg == "--depfile") {
+         opts.depfile = safe_s(i);
+      } else if(arg == "--dyndep") {
+         opts.dyndep_dir = safe_s(i);
+      } else if(arg == "--scan-deps") {
+         opts.scan_deps_file = safe_s(i);
+      } else if(arg == "--primary-output") {
+         opts.primary_output = safe_s(i);
+      } else if(arg == "--collate") {
+         opts.collate = true;
+      } else if(!arg.empty() && arg[0] != '-') {
+         opts.collate_files.push_back(arg);
+      } else if(arg == "--timings") {
+         opts.timings_file = safe_s(i);
+      } else if(arg == "--serve") {
+         opts.serve_socket = safe_s(i);
+      } else if(arg == "--connect") {
+         opts.connect_socket = safe_s(i);
+      } else if(arg == "--stats") {
+         opts.show_stats = true;
+      } else if(arg == "--trace") {
+         opts.trace_file = safe_s(i);
+      } else if(starts_with(arg, "--trace=")) {
+         opts.trace_file = arg.substr(8);
+      } else if(arg == "--shard") {
+         opts.shard_output = true;
+      } else if(arg == "--regex-globs") {
+         opts.regex_globs = true;
+      } else if(arg == "--diff") {
+         opts.diff_file = safe_s(i);
+      } else if(arg == "--no-unity") {
+         opts.unity_build = false;
+      } else if(arg == "--check-modules") {
+         opts.check_modules = true;
+      } else if(arg == "--module-depth") {
+         opts.check_modules = opts.module_depth = true;
+      } else if(arg == "-D") {
+         process_define(safe_s(i), opts.defines);
+      } else if(starts_with(arg, "-D")) {
+         process_define(&arg[2], opts.defines);
+      } else if(arg == "--config") {
+         process_config(safe_s(i));
+      } else if(starts_with(arg, "--config=")) {
+         process_config(arg.substr(9));
+      } else {
+         fprintf(err, "Unknown argument '%s'.\n", argv[i]);
+         opts.has_error = true;
+      }
+   }
+
+   if(!opts.collate && !opts.collate_files.empty()) {
+      fprintf(err, "Unknown argument '%s'.\n", opts.collate_files[0].c_str());
+      opts.has_error = true;
+   }
+
+   if(!opts.show_help && opts.in_file == "" && opts.serve_socket == ""
+      && opts.scan_deps_file == "" && !opts.collate) {
+      fprintf(err, "Must specify an input file.\n");
+      opts.has_error = true;
+   }
+
+   if(opts.shard_output && (opts.out_file == "" || opts.out_file == "-")) {
+      fprintf(err, "--shard requires an output file.\n");
+      opts.has_error = true;
+   }
+
+   if(!opts.diff_file.empty() && (opts.out_file == "" || opts.out_file == "-")) {
+      fprintf(err, "--diff requires an output file.\n");
+      opts.has_error = true;
+   }
+
+   if(!opts.depfile.empty()
+      && (opts.out_file == "" || opts.out_file == "-" || opts.in_file == "-")) {
+      fprintf(err, "--depfile requires an input file and an output file.\n");
+      opts.has_error = true;
+   }
+
+   if(opts.check_modules && !opts.dyndep_dir.empty()) {
+      fprintf(err,
+              "--check-modules cannot be used with --dyndep, which scans "
+              "when building.\n");
+      opts.has_error = true;
+   }
+
+   if(!opts.configs.empty() && !opts.serve_socket.empty()) {
+      fprintf(err, "--config cannot be used with --serve.\n");
+      opts.has_error = true;
+   }
+
+   // Each configuration needs its own output files
+   if(opts.configs.size() > 1) {
+      auto check_filename = [&](const string& filename, const char* what) {
+         if(filename.empty() || filename == "-"
+            || filename.find("{config}") == string::npos) {
+            fprintf(err,
+                    "With several --config, %s must name a file that "
+                    "contains '{config}'.\n",
+                    what);
+            opts.has_error = true;
+         }
+      };
+      check_filename(opts.out_file, "-o");
+      if(!opts.depfile.empty()) check_filename(opts.depfile, "--depfile");
+      if(!opts.timings_file.empty())
+         check_filename(opts.timings_file, "--timings");
+      if(!opts.trace_file.empty()) check_filename(opts.trace_file, "--trace");
+   }
+
+   return opts;
+}
+
+// ------------------------------------------------------------------ run-mobius
+
+static bool run_mobius(Run& run)
+{
+   const auto& opts = run.opts;
+   if(!opts.configs.empty() && run.shared == nullptr)
+      return run_configurations(run);
+
+   // -- Setup input/output files
+   Profile profile;
+   profile.tracing = !opts.trace_file.empty();
+   const bool profiling
+       = opts.show_stats || profile.tracing || !opts.timings_file.empty();
+   InputReader in;
+   const bool to_stdout = (opts.out_file == "-" || opts.out_file == "");
+   const bool to_file   = !to_stdout && run.captured == nullptr;
+   bool has_input       = true;
+   if(run.input != nullptr)
+      open_input_string(in, *run.input);
+   else
+      has_input = open_input(in, opts.in_file);
+   if(!has_input)
+      fprintf(run.err, "failed to open input file '%s'\n", opts.in_file.c_str());
+
+   // -- Transform input into output. An output file is left untouched on
+   //    failure, or if nothing changed.
+   try {
+      if(has_input) {
+         // With --diff, the old manifest is read before it's replaced
+         NinjaManifest old_manifest;
+         if(!opts.diff_file.empty())
+            read_ninja_manifest(opts.diff_file, old_manifest);
+
+         WriteIfChanged out_file;
+         if(to_file) open_write_if_changed(out_file, opts.out_file);
+         OutputBuffer out(to_stdout && run.captured == nullptr ? STDOUT_FILENO
+                                                               : -1);
+         if(to_file) out.file = &out_file;
+         State state(opts, in, out);
+         if(profiling) state.profile = out.profile = &profile;
+         const bool serving = run.resident != nullptr && run.shared == nullptr;
+         state.err            = run.err;
+         state.environment    = run.environment;
+         state.track_inputs   = serving || !opts.depfile.empty();
+         state.cache_resident = (run.resident != nullptr);
+         state.caching = !opts.cache_file.empty() || run.resident != nullptr;
+         state.shared  = run.shared;
+
+         // The engine (or --config) lends its cache to the run
+         ResidentCacheLoan loan(run.resident, state.cache);
+         const bool success = transform_input(state);
+         if(success && !opts.depfile.empty()) save_depfile(state);
+
+         if(serving) {
+            run.listed_dirs = std::move(state.listed_dirs);
+            run.read_files  = std::move(state.read_files);
+            if(run.input == nullptr && opts.in_file != "-")
+               run.read_files.push_back(absolute_path(state, opts.in_file));
+         }
+
+         flush_output(out);
+         if(success && opts.shard_output) commit_shards(state);
+         if(run.captured != nullptr) *run.captured = std::move(out.buffer);
+         run.shards_changed = state.shards_changed;
+
+         // Ninja only rereads the shards if the output itself changes
+         if(success && to_file && !commit_write_if_changed(out_file)
+            && !opts.depfile.empty() && state.shards_changed)
+            touch_file(opts.out_file);
+         if(success && !opts.diff_file.empty()) {
+            NinjaManifest new_manifest;
+            if(run.captured != nullptr) {
+               unordered_map<string, string> scope;
+               parse_ninja_manifest(*run.captured, scope, new_manifest, 0);
+            } else {
+               read_ninja_manifest(opts.out_file, new_manifest);
+            }
+            print_manifest_diff(
+                run.err, opts.diff_file, old_manifest, new_manifest);
+         }
+         if(success && profiling) {
+            finish_profile(profile);
+            if(!opts.timings_file.empty())
+               save_timings(profile, opts.timings_file);
+            if(!opts.trace_file.empty()) save_trace(profile, opts.trace_file);
+            if(opts.show_stats) print_stats(profile, run.err);
+         }
+         return success;
+      }
+   } catch(std::exception& e) {
+      string err = e.what();
+      fprintf(run.err, "exception tranforming input: \"%s\"\n", err.c_str());
+   }
+
+   // -- Done
+   return false;
+}
+
+// ------------------------------------------------ cached environment variables
+
+static decltype(auto) getenv(State& state, const string& s)
+{
+   auto ii = state.env.find(s);
+   if(ii == state.env.end()) {
+      if(state.environment != nullptr) {
+         const auto jj = state.environment->find(s);
+         if(jj == state.environment->end()) return state.env.end();
+         state.env_reads.emplace_back(s, jj->second);
+         return state.env.emplace(s, jj->second).first;
+      }
+      auto var = ::getenv(s.c_str());
+      if(var == nullptr) return state.env.end();
+      state.env_reads.emplace_back(s, var);
+      state.env[s] = string(var);
+      ii           = state.env.find(s);
+   }
+   return ii;
+}
+
+// The variable's value, or nullptr if it is not set. Memoized, so naming a
+// variable again costs a lookup, without building a string. (The memo
+// points into 'env', whose entries are stable, and only ever updated.)
+static const string* lookup_variable(State& state, string_view name)
+{
+   const auto ii = state.variables.find(name);
+   if(ii != state.variables.end()) return ii->second;
+
+   const auto jj = getenv(state, string(name));
+   if(jj == state.env.end()) return nullptr;
+   state.variables.emplace(jj->first, &jj->second);
+   return &jj->second;
+}
+
+static void parse_line_segments(string_view line,
+                                vector<LineSegment>& segments)
+{
+   segments.clear();
+   auto add_literal = [&](string_view text) {
+      if(text.empty()) return;
+      if(!segments.empty() && segments.back().kind == LineSegment::LITERAL
+         && segments.back().text.data() + segments.back().text.size()
+                == text.data())
+         segments.back().text = string_view(segments.back().text.data(),
+                                            segments.back().text.size()
+                                                + text.size());
+      else
+         segments.push_back({LineSegment::LITERAL, text, {}});
+   };
+
+   size_t pos = 0;
+   while(pos < line.size()) {
+      const auto dollar = line.find('$', pos);
+      add_literal(line.substr(pos, dollar - pos));
+      if(dollar == string_view::npos) break;
+
+      // '$x' (including '$$') is ninja's business; a trailing '$' is dropped
+      pos = dollar + 1;
+      if(pos == line.size()) break;
+      if(line[pos] != '{') {
+         add_literal(line.substr(dollar, 2));
+         ++pos;
+         continue;
+      }
+
+      // '${name}', '${name:-word}' or '${name:?word}', where 'word' may
+      // have variables of its own
+      const auto close = line.find('}', pos);
+      if(close == string_view::npos)
+         throw std::runtime_error("parse error reading variable name, "
+                                  "missing '}'");
+      const auto colon = line.find(':', pos);
+      if(colon < close && colon + 1 < line.size()
+         && (line[colon + 1] == '-' || line[colon + 1] == '?')) {
+         auto end = colon + 2;
+         for(auto depth = 0; end < line.size(); ++end) {
+            if(line[end] == '{' && line[end - 1] == '$') ++depth;
+            if(line[end] == '}' && depth-- == 0) break;
+         }
+         if(end == line.size())
+            throw std::runtime_error("parse error reading variable name, "
+                                     "missing '}'");
+         segments.push_back({line[colon + 1] == '-' ? LineSegment::DEFAULT
+                                                    : LineSegment::REQUIRED,
+                             line.substr(pos + 1, colon - pos - 1),
+                             line.substr(colon + 2, end - colon - 2)});
+         pos = end + 1;
+      } else {
+         segments.push_back(
+             {LineSegment::VARIABLE, line.substr(pos + 1, close - pos - 1), {}});
+         pos = close + 1;
+      }
+   }
+}
+
+// Values are written straight to 'out', so a large value (like a filter
+// variable) is never copied into a line first
+static void expand_segments(State& state,
+                            const vector<LineSegment>& segments,
+                            OutputBuffer& out)
+{
+   for(const auto& segment : segments) {
+      if(segment.kind == LineSegment::LITERAL) {
+         out << segment.text;
+         continue;
+      }
+
+      const auto value = lookup_variable(state, segment.text);
+      const bool unset = (value == nullptr)
+                         || (segment.kind != LineSegment::VARIABLE
+                             && value->empty());
+      if(!unset) {
+         out << *value;
+      } else if(segment.kind == LineSegment::DEFAULT) {
+         expand_variables(state, segment.word, out);
+      } else if(segment.kind == LineSegment::REQUIRED) {
+         OutputBuffer message;
+         expand_variables(state, segment.word, message);
+         throw std::runtime_error(
+             "environment variable '" + string(segment.text) + "'"
+             + (message.buffer.empty() ? " not set"s : ": " + message.buffer));
+      } else {
+         throw std::runtime_error("environment variable '"
+                                  + string(segment.text) + "' not found");
+      }
+   }
+}
+
+static void expand_variables(State& state, string_view line, OutputBuffer& out)
+{
+   if(line.find('$') == string_view::npos) {
+      out << line;
+      return;
+   }
+
+   // Reuses 'state.line_segments', unless they're in use, because this is
+   // the word of a default
+   vector<LineSegment> nested;
+   auto& segments = state.line_segments.empty() ? state.line_segments : nested;
+   parse_line_segments(line, segments);
+   expand_segments(state, segments, out);
+   segments.clear();
+}
+
+static string_view substitute_env_variables(State& state, string_view line)
+{
+   if(line.find('$') == string_view::npos) return line;
+   state.line_scratch.buffer.clear();
+   expand_variables(state, line, state.line_scratch);
+   return state.line_scratch.buffer;
+}
+
+// ----------------------------------------------------------------------- input
+
+InputReader::~InputReader()
+{
+   if(mapped) munmap(const_cast<char*>(data), size);
+   if(owns_fd) close(fd);
+}
+
+static bool open_input(InputReader& in, const string& filename)
+{
+   if(filename == "-") {
+      in.fd = STDIN_FILENO;
+   } else {
+      in.fd      = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+      in.owns_fd = (in.fd >= 0);
+   }
+   if(in.fd < 0) return false;
+
+   struct stat st;
+   if(fstat(in.fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+      void* data
+          = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, in.fd, 0);
+      if(data != MAP_FAILED) {
+         in.mapped = true;
+         in.data   = static_cast<const char*>(data);
+         in.size   = size_t(st.st_size);
+         madvise(data, in.size, MADV_SEQUENTIAL);
+      }
+   }
+   return true;
+}
+
+// Reads the lines of 'data', which was sent by a client
+static void open_input_string(InputReader& in, const string& data)
+{
+   in.block = data;
+   in.eof   = true;
+}
+
+// Reads the next line, without its '\n', like std::getline
+static bool read_line(InputReader& in, string_view& line)
+{
+   if(in.mapped) {
+      if(in.pos >= in.size) return false;
+      const auto start = in.data + in.pos;
+      const auto eol
+          = static_cast<const char*>(memchr(start, '\n', in.size - in.pos));
+      const auto len
+          = (eol == nullptr) ? in.size - in.pos : size_t(eol - start);
+      line           = string_view(start, len);
+      in.pos += len + 1;
+      return true;
+   }
+
+   for(;;) {
+      const auto eol = in.block.find('\n', std::max(in.pos, in.scanned));
+      if(eol != string::npos) {
+         line   = string_view(in.block).substr(in.pos, eol - in.pos);
+         in.pos = eol + 1;
+         return true;
+      }
+
+      if(in.eof) {
+         if(in.pos >= in.block.size()) return false;
+         line   = string_view(in.block).substr(in.pos);
+         in.pos = in.block.size();
+         return true;
+      }
+
+      // Drop the lines already read, and read another block
+      in.block.erase(0, in.pos);
+      in.pos     = 0;
+      in.scanned = in.block.size();
+      in.block.resize(in.scanned + InputReader::k_block_size);
+      const auto n
+          = read(in.fd, &in.block[in.scanned], InputReader::k_block_size);
+      if(n < 0 && errno == EINTR) {
+         in.block.resize(in.scanned);
+         continue;
+      }
+      if(n < 0)
+         throw std::runtime_error("failed to read input: "s + strerror(errno));
+      in.block.resize(in.scanned + size_t(n));
+      in.eof = (n == 0);
+   }
+}
+
+// --------------------------------------------------------------- output-buffer
+
+static OutputBuffer& operator<<(OutputBuffer& out, string_view s)
+{
+   out.buffer.append(s);
+   if((out.fd >= 0 || out.file != nullptr)
+      && out.buffer.size() >= OutputBuffer::k_chunk_size)
+      flush_output(out);
+   return out;
+}
+
+static OutputBuffer& operator<<(OutputBuffer& out, char c)
+{
+   out.buffer.push_back(c);
+   return out;
+}
+
+static void write_all(int fd, const char* data, size_t size)
+{
+   while(size > 0) {
+      const auto n = write(fd, data, size);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0)
+         throw std::runtime_error("failed to write output: "s
+                                  + strerror(errno));
+      data += n;
+      size -= size_t(n);
+   }
+}
+
+static void flush_output(OutputBuffer& out)
+{
+   PhaseTimer timer(out.profile, Profile::OUTPUT);
+   if(out.profile != nullptr) out.profile->n_bytes_written += out.buffer.size();
+   if(out.file != nullptr)
+      write_if_changed(*out.file, out.buffer);
+   else if(out.fd >= 0)
+      write_all(out.fd, out.buffer.data(), out.buffer.size());
+   else
+      return;
+   out.buffer.clear();
+}
+
+// --------------------------------------------------------------------- profile
+
+static const char* phase_names[Profile::N_PHASES]
+    = {"other", "walk", "match", "substitute", "scan", "filter", "output"};
+
+// Seconds since the run started
+static double profile_clock(const Profile& profile)
+{
+   return std::chrono::duration<double>(Profile::clock::now() - profile.start)
+       .count();
+}
+
+// Cpu seconds, of all threads
+static double process_cpu_clock()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+   return double(ts.tv_sec) + 1e-9 * double(ts.tv_nsec);
+}
+
+static void switch_phase(Profile& profile, Profile::Phase phase)
+{
+   const auto now     = profile_clock(profile);
+   const auto now_cpu = process_cpu_clock();
+   profile.seconds[profile.phase] += now - profile.since;
+   profile.cpu_seconds[profile.phase] += now_cpu - profile.since_cpu;
+   profile.since     = now;
+   profile.since_cpu = now_cpu;
+   profile.phase     = phase;
+}
+
+PhaseTimer::PhaseTimer(Profile* profile_, Profile::Phase phase_, bool traced_)
+    : profile(profile_)
+    , phase(phase_)
+    , traced(traced_)
+{
+   if(profile == nullptr) return;
+   previous = profile->phase;
+   switch_phase(*profile, phase);
+   start = profile->since;
+}
+
+PhaseTimer::~PhaseTimer()
+{
+   if(profile == nullptr) return;
+   switch_phase(*profile, previous);
+   if(traced && profile->tracing)
+      profile->events.push_back(
+          {phase_names[phase], "phase", start, profile->since - start});
+}
+
+// Charges the time up until now
+static void finish_profile(Profile& profile)
+{
+   switch_phase(profile, Profile::OTHER);
+}
+
+static void save_timings(const Profile& profile, const string& filename)
+{
+   std::ofstream fout(filename);
+   double total = 0.0;
+   fout << "phase\tseconds\n";
+   for(auto i = 0; i < Profile::N_PHASES; ++i) {
+      fout << phase_names[i] << '\t' << profile.seconds[i] << '\n';
+      total += profile.seconds[i];
+   }
+   fout << "total\t" << total << '\n';
+   if(!fout)
+      throw std::runtime_error("failed to write timings file '" + filename
+                               + "'");
+}
+
+static string json_escape(string_view s)
+{
+   string escaped;
+   escaped.reserve(s.size());
+   for(auto c : s) {
+      if(c == '"' || c == '\\') {
+         escaped += '\\';
+         escaped += c;
+      } else if(static_cast<unsigned char>(c) < 0x20) {
+         char buf[8];
+         snprintf(buf, sizeof(buf), "\\u%04x", unsigned(c));
+         escaped += buf;
+      } else {
+         escaped += c;
+      }
+   }
+   return escaped;
+}
+
+static void save_trace(const Profile& profile, const string& filename)
+{
+   FILE* fp = fopen(filename.c_str(), "w");
+   if(fp == nullptr)
+      throw std::runtime_error("failed to open trace file '" + filename
+                               + "'");
+
+   auto write_event = [&](const string& name,
+                          const char* category,
+                          double start,
+                          double duration,
+                          bool is_first) {
+      fprintf(fp,
+              "%s\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+              "\"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1}",
+              (is_first ? "" : ","),
+              json_escape(name).c_str(),
+              category,
+              start * 1e6,
+              duration * 1e6);
+   };
+
+   fprintf(fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+   bool is_first = true;
+   for(const auto& block : profile.blocks) {
+      write_event(block.name, "block", block.start, block.seconds, is_first);
+      is_first = false;
+   }
+   for(const auto& event : profile.events) {
+      write_event(
+          event.name, event.category, event.start, event.duration, is_first);
+      is_first = false;
+   }
+   fprintf(fp, "\n]}\n");
+
+   if(fclose(fp) != 0)
+      throw std::runtime_error("failed to write trace file '" + filename
+                               + "'");
+}
+
+static void print_stats(const Profile& profile, FILE* fp)
+{
+   double total = 0.0, total_cpu = 0.0;
+   fprintf(fp, "%-24s %10s %10s\n", "phases", "wall (s)", "cpu (s)");
+   for(auto i = 0; i < Profile::N_PHASES; ++i) {
+      fprintf(fp,
+              "   %-21s %10.6f %10.6f\n",
+              phase_names[i],
+              profile.seconds[i],
+              profile.cpu_seconds[i]);
+      total += profile.seconds[i];
+      total_cpu += profile.cpu_seconds[i];
+   }
+   fprintf(fp, "   %-21s %10.6f %10.6f\n", "total", total, total_cpu);
+
+   fprintf(fp, "\n+src blocks\n");
+   for(const auto& block : profile.blocks) {
+      fprintf(fp,
+              "   %s%s\n",
+              block.name.c_str(),
+              (block.from_cache ? "  (cached)" : ""));
+      fprintf(fp,
+              "      %-18s %10.6f %10.6f\n",
+              "wall, cpu (s)",
+              block.seconds,
+              block.cpu_seconds);
+      fprintf(fp,
+              "      %-18s %10lu\n",
+              "files",
+              static_cast<unsigned long>(block.n_files));
+      for(const auto& [pattern, count] : block.rule_matches)
+         fprintf(fp,
+                 "      - %-16s %10lu\n",
+                 pattern.c_str(),
+                 static_cast<unsigned long>(count));
+   }
+
+   auto counter = [&](const char* name, uint64_t value) {
+      fprintf(fp, "   %-21s %10lu\n", name, static_cast<unsigned long>(value));
+   };
+   fprintf(fp, "\ncounters\n");
+   counter("files visited", profile.n_files_visited);
+   counter("glob evaluations", profile.n_glob_evaluations);
+   counter("regex evaluations", profile.n_regex_evaluations);
+   counter("files scanned", profile.n_files_scanned);
+   counter("bytes scanned", profile.n_bytes_scanned);
+   counter("bytes written", profile.n_bytes_written);
+}
+
+// ------------------------------------------------------------ write-if-changed
+
+WriteIfChanged::~WriteIfChanged()
+{
+   if(fd >= 0) close(fd);
+   if(!tmp_filename.empty()) unlink(tmp_filename.c_str());
+   if(old_data != nullptr) munmap(const_cast<char*>(old_data), old_size);
+}
+
+static void open_write_if_changed(WriteIfChanged& file, const string& filename)
+{
+   file.filename = filename;
+
+   const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+   if(fd < 0) return; // rewritten (created) when committed
+
+   struct stat st;
+   if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+      file.old_exists = true;
+      file.old_size   = size_t(st.st_size);
+      if(file.old_size > 0) {
+         void* data
+             = mmap(nullptr, file.old_size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if(data == MAP_FAILED) {
+            file.old_exists = false; // just rewrite it
+            file.old_size   = 0;
+         } else {
+            file.old_data = static_cast<const char*>(data);
+         }
+      }
+   }
+   close(fd);
+}
+
+// Opens the temporary file, and writes the output so far, which is the same
+// as the start of the existing file.
+// The temporary file is unique to this call, since other threads (--config)
+// may be writing the same file.
+static void begin_rewrite(WriteIfChanged& file)
+{
+   static std::atomic<unsigned> n_rewrites{0};
+   file.tmp_filename = file.filename + ".tmp" + std::to_string(getpid()) + "."
+                       + std::to_string(n_rewrites++);
+   file.fd           = open(file.tmp_filename.c_str(),
+                  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0666);
+   if(file.fd < 0) {
+      file.tmp_filename.clear();
+      throw std::runtime_error("failed to open output file '" + file.filename
+                               + "': " + strerror(errno));
+   }
+   write_all(file.fd, file.old_data, file.offset);
+}
+
+static void write_if_changed(WriteIfChanged& file, string_view data)
+{
+   if(data.empty()) return;
+   if(file.fd < 0) {
+      if(file.offset + data.size() <= file.old_size
+         && memcmp(file.old_data + file.offset, data.data(), data.size())
+                == 0) {
+         file.offset += data.size();
+         return;
+      }
+      begin_rewrite(file);
+   }
+   write_all(file.fd, data.data(), data.size());
+   file.offset += data.size();
+}
+
+// Returns TRUE if the file was replaced
+static bool commit_write_if_changed(WriteIfChanged& file)
+{
+   if(file.fd < 0) {
+      if(file.old_exists && file.offset == file.old_size) return false;
+      begin_rewrite(file);
+   }
+
+   const bool closed = (close(file.fd) == 0);
+   file.fd           = -1;
+   if(!closed || rename(file.tmp_filename.c_str(), file.filename.c_str()) != 0)
+      throw std::runtime_error("failed to write output file '" + file.filename
+                               + "': " + strerror(errno));
+   file.tmp_filename.clear();
+   return true;
+}
+
+void touch_file(const string& filename)
+{
+   if(utimensat(AT_FDCWD, filename.c_str(), nullptr, 0) != 0)
+      throw std::runtime_error("failed to touch '" + filename
+                               + "': " + strerror(errno));
+}
+
+// ---------------------------------------------------------------- ninja-escape
+
+// Escapes a path for use in a ninja build or subninja statement
+static string ninja_escape(string_view path)
+{
+   string escaped;
+   escaped.reserve(path.size());
+   for(auto c : path) {
+      if(c == '$' || c == ' ' || c == ':') escaped += '$';
+      escaped += c;
+   }
+   return escaped;
+}
+
+// Escapes the value of a ninja variable, which cannot span lines
+static string ninja_escape_value(string_view value)
+{
+   string escaped;
+   escaped.reserve(value.size());
+   for(auto c : value) {
+      if(c == '\n')
+         throw std::runtime_error("cannot write a newline into ninja: '"
+                                  + string(value) + "'");
+      if(c == '$') escaped += '$';
+      escaped += c;
+   }
+   return escaped;
+}
+
+// ----------------------------------------------------------------------- shard
+
+// Ninja reads 'subninja' paths from its working directory, which is
+// mobius's too
+static string shard_filename(const Options& opts, unsigned ind)
+{
+   return opts.out_file + ".shards/" + std::to_string(ind) + ".ninja";
+}
+
+static void make_shard_directory(const Options& opts)
+{
+   const auto dname = opts.out_file + ".shards";
+   if(mkdir(dname.c_str(), 0777) != 0 && errno != EEXIST)
+      throw std::runtime_error("failed to create directory '" + dname
+                               + "': " + strerror(errno));
+}
+
+// Removes shards left over from when there were more +src blocks
+static void remove_stale_shards(const Options& opts, unsigned n_src_blocks)
+{
+   for(auto ind = n_src_blocks;
+       unlink(shard_filename(opts, ind).c_str()) == 0;
+       ++ind)
+      ;
+}
+
+// Replaces the shards that changed, once the whole output has succeeded,
+// so that a failed run leaves the old shards with the old output
+static void commit_shards(State& state)
+{
+   for(auto& shard : state.shards)
+      if(commit_write_if_changed(shard->file)) state.shards_changed = true;
+   state.shards.clear();
+   remove_stale_shards(state.opts, state.n_src_blocks);
+}
+
+// ------------------------------------------------------------------ regenerate
+
+// Quotes an argument for sh(1), if it needs quoting
+static string shell_quote(string_view arg)
+{
+   const bool plain
+       = !arg.empty() && std::all_of(arg.begin(), arg.end(), [](char c) {
+            return std::isalnum(static_cast<unsigned char>(c))
+                   || (c != '\0' && strchr("%+,-./:=@_", c) != nullptr);
+         });
+   if(plain) return string(arg);
+
+   string quoted = "'";
+   for(auto c : arg) {
+      if(c == '\'')
+         quoted += "'\\''";
+      else
+         quoted += c;
+   }
+   return quoted + "'";
+}
+
+// Escapes a path in a depfile, as ninja reads them
+static string depfile_escape(string_view path)
+{
+   string escaped;
+   escaped.reserve(path.size());
+   for(auto c : path) {
+      if(c == ' ' || c == '#') escaped += '\\';
+      if(c == '$') escaped += '$';
+      escaped += c;
+   }
+   return escaped;
+}
+
+// The mobius executable, for the commands that the output runs. The library
+// cannot know it (in a build driver, /proc/self/exe is the driver).
+static const string& mobius_command(const State& state)
+{
+   if(state.opts.mobius_command.empty())
+      throw std::runtime_error(
+          "--depfile and --dyndep need the mobius executable, in "
+          "Options::mobius_command");
+   return state.opts.mobius_command;
+}
+
+// The command line that reproduces this run: the same options, with the
+// variables that were read from the environment passed as -D
+static vector<string> regenerate_command(const State& state)
+{
+   const auto& opts = state.opts;
+   vector<string> args{mobius_command(state),
+                       "-i",
+                       opts.in_file,
+                       "-o",
+                       opts.out_file,
+                       "--depfile",
+                       opts.depfile};
+   if(!opts.module_dir.empty()) args.insert(args.end(), {"-m", opts.module_dir});
+   if(!opts.cache_file.empty()) args.insert(args.end(), {"-c", opts.cache_file});
+   if(opts.n_threads != 0)
+      args.insert(args.end(), {"-j", std::to_string(opts.n_threads)});
+   if(!opts.dyndep_dir.empty())
+      args.insert(args.end(), {"--dyndep", opts.dyndep_dir});
+   if(opts.shard_output) args.push_back("--shard");
+   if(opts.regex_globs) args.push_back("--regex-globs");
+   if(!opts.unity_build) args.push_back("--no-unity");
+   if(opts.module_depth)
+      args.push_back("--module-depth");
+   else if(opts.check_modules)
+      args.push_back("--check-modules");
+   if(!opts.connect_socket.empty())
+      args.insert(args.end(), {"--connect", opts.connect_socket});
+
+   vector<std::pair<string, string>> defines(opts.defines.begin(),
+                                             opts.defines.end());
+   defines.insert(
+       defines.end(), state.env_reads.begin(), state.env_reads.end());
+   std::sort(defines.begin(), defines.end());
+   for(const auto& [name, value] : defines)
+      args.push_back("-D" + name + "=" + value);
+   return args;
+}
+
+// Adds an edge that reruns mobius whenever anything in the depfile changes
+static void write_regenerate_edge(State& state)
+{
+   const auto& opts = state.opts;
+   string command;
+   for(const auto& arg : regenerate_command(state)) {
+      if(!command.empty()) command += ' ';
+      command += shell_quote(arg);
+   }
+
+   state.out << "\nrule mobius_regenerate\n   command = "
+             << ninja_escape_value(command)
+             << "\n   description = Regenerating $out\n"
+             << "   generator = 1\n   restat = 1\n   depfile = "
+             << ninja_escape_value(opts.depfile) << "\nbuild "
+             << ninja_escape(opts.out_file)
+             << ": mobius_regenerate " << ninja_escape(opts.in_file) << '\n';
+}
+
+// The depfile lists the input file, every directory listed, and every file
+// scanned for '?'. (A directory changes when a file is added to, or removed
+// from, it.)
+static void save_depfile(const State& state)
+{
+   vector<string> deps = state.listed_dirs;
+   deps.insert(deps.end(), state.read_files.begin(), state.read_files.end());
+   deps.push_back(absolute_path(state, state.opts.in_file));
+   std::sort(deps.begin(), deps.end());
+   deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+
+   string contents = depfile_escape(state.opts.out_file) + ":";
+   for(const auto& dep : deps) contents += " \\\n   " + depfile_escape(dep);
+   contents += '\n';
+   write_result(state.opts.depfile, contents);
+}
+
+// -----------------------------------------------------------------------------
+// --                           String Funcitons                              --
+// -----------------------------------------------------------------------------
+
+// ----------------------------------------------------------------- starts-with
+
+static bool starts_with(string_view s, string_view prefix)
+{
+   auto pos = 0u;
+   while(pos < s.size() && std::isspace(s[pos])) ++pos;
+   return std::mismatch(prefix.begin(), prefix.end(), s.begin() + pos, s.end())
+              .first
+          == prefix.end();
+}
+
+// ------------------------------------------------------------------------ trim
+
+static void ltrim(std::string& s)
+{
+   s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](int ch) {
+              return !std::isspace(ch);
+           }));
+}
+
+// trim from end (in place)
+static void rtrim(std::string& s)
+{
+   s.erase(std::find_if(
+               s.rbegin(), s.rend(), [](int ch) { return !std::isspace(ch); })
+               .base(),
+           s.end());
+}
+
+// trim from both ends (in place)
+static void trim(std::string& s)
+{
+   ltrim(s);
+   rtrim(s);
+}
+
+static bool is_empty_line(const std::string& s)
+{
+   for(auto c : s)
+      if(!std::isspace(c)) return false;
+   return true;
+}
+
+template<class U, class V> static bool ends_with(const U& input, const V& match)
+{
+   return input.size() >= match.size()
+          and std::equal(crbegin(match), crend(match), rbegin(input));
+}
+
+// ------------------------------------------------------------- make-regex-glob
+
+static std::regex make_regex_glob(const string& pattern)
+{
+   int len         = pattern.size();
+   int pos         = 0;
+   char* buffer    = static_cast<char*>(alloca(len * 2 + 1));
+   const char* src = pattern.c_str();
+
+   while(*src) {
+      switch(*src) {
+      case '\\':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '\\';
+         break;
+      case '^':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '^';
+         break;
+      case '.':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '.';
+         break;
+      case '$':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '$';
+         break;
+      case '|':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '|';
+         break;
+      case '(':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '(';
+         break;
+      case ')':
+         buffer[pos++] = '\\';
+         buffer[pos++] = ')';
+         break;
+      case '[':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '[';
+         break;
+      case ']':
+         buffer[pos++] = '\\';
+         buffer[pos++] = ']';
+         break;
+      case '+':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '+';
+         break;
+      case '/':
+         buffer[pos++] = '\\';
+         buffer[pos++] = '/';
+         break;
+      case '?': buffer[pos++] = '.'; break;
+      case '*':
+         buffer[pos++] = '.';
+         buffer[pos++] = '*';
+         break;
+      default: buffer[pos++] = *src;
+      }
+      src++;
+   }
+   buffer[pos++] = '\0';
+
+   return std::regex(buffer);
+}
+
+// ------------------------------------------------------------------- make-glob
+
+static Glob make_glob(const string& pattern, bool use_regex)
+{
+   Glob glob;
+   glob.pattern = pattern;
+
+   if(use_regex) {
+      glob.kind  = Glob::REGEX;
+      glob.regex = make_regex_glob(pattern);
+      return glob;
+   }
+
+   // ---- Tokenize
+   vector<GlobToken> tokens;
+   auto push_literal = [&](char c) {
+      if(tokens.empty() || tokens.back().type != GlobToken::LITERAL)
+         tokens.emplace_back();
+      tokens.back().literal += c;
+   };
+   auto push_token = [&](GlobToken::Type type) {
+      tokens.emplace_back();
+      tokens.back().type = type;
+   };
+
+   const auto len = pattern.size();
+   for(auto i = 0u; i < len; ++i) {
+      const char c = pattern[i];
+      switch(c) {
+      case '\\':
+         push_literal(i + 1 < len ? pattern[++i] : c);
+         break;
+      case '?': push_token(GlobToken::ANY_CHAR); break;
+      case '*':
+         if(i + 1 < len && pattern[i + 1] == '*') {
+            while(i + 1 < len && pattern[i + 1] == '*') ++i;
+            if(i + 1 < len && pattern[i + 1] == '/') {
+               push_token(GlobToken::GLOBSTAR);
+               ++i; // consumes the '/'
+               break;
+            }
+         }
+         if(tokens.empty() || tokens.back().type != GlobToken::STAR)
+            push_token(GlobToken::STAR);
+         break;
+      case '[': {
+         // Find the closing ']', where a leading ']' is a literal
+         auto j = i + 1;
+         const bool negate = j < len && (pattern[j] == '!' || pattern[j] == '^');
+         if(negate) ++j;
+         const auto first = j;
+         if(j < len && pattern[j] == ']') ++j;
+         while(j < len && pattern[j] != ']') ++j;
+         if(j >= len) { // unterminated: treat '[' as a literal
+            push_literal(c);
+            break;
+         }
+
+         std::bitset<256> char_class;
+         for(auto k = first; k < j; ++k) {
+            const auto lo = uint8_t(pattern[k]);
+            if(k + 2 < j && pattern[k + 1] == '-') {
+               const auto hi = uint8_t(pattern[k + 2]);
+               for(auto x = unsigned(lo); x <= unsigned(hi); ++x)
+                  char_class.set(x);
+               k += 2;
+            } else {
+               char_class.set(lo);
+            }
+         }
+         if(negate) char_class.flip();
+
+         push_token(GlobToken::CHAR_CLASS);
+         tokens.back().char_class = char_class;
+         i                        = j;
+      } break;
+      default: push_literal(c);
+      }
+   }
+
+   // ---- Peel off the literal prefix and suffix
+   auto begin = tokens.begin();
+   auto end   = tokens.end();
+   if(begin != end && begin->type == GlobToken::LITERAL)
+      glob.prefix = std::move((begin++)->literal);
+   if(begin == end) {
+      glob.kind = Glob::EXACT;
+      return glob;
+   }
+   if(begin != end && std::prev(end)->type == GlobToken::LITERAL)
+      glob.suffix = std::move((--end)->literal);
+
+   // ---- Classify, so that common patterns (i.e., '*.cpp') avoid tokens
+   if(std::distance(begin, end) == 1 && begin->type == GlobToken::STAR) {
+      if(glob.suffix.empty())
+         glob.kind = Glob::PREFIX;
+      else if(glob.prefix.empty())
+         glob.kind = Glob::SUFFIX;
+      else
+         glob.kind = Glob::PREFIX_SUFFIX;
+   } else {
+      glob.kind = Glob::GENERAL;
+      glob.tokens.assign(std::make_move_iterator(begin),
+                         std::make_move_iterator(end));
+   }
+
+   return glob;
+}
+
+// ------------------------------------------------------------------ glob-match
+
+static bool glob_match_tokens(const GlobToken* token,
+                              const GlobToken* end,
+                              string_view s)
+{
+   for(; token != end; ++token) {
+      switch(token->type) {
+      case GlobToken::LITERAL:
+         if(s.compare(0, token->literal.size(), token->literal) != 0)
+            return false;
+         s.remove_prefix(token->literal.size());
+         break;
+
+      case GlobToken::ANY_CHAR:
+         if(s.empty()) return false;
+         s.remove_prefix(1);
+         break;
+
+      case GlobToken::CHAR_CLASS:
+         if(s.empty() || !token->char_class[uint8_t(s[0])]) return false;
+         s.remove_prefix(1);
+         break;
+
+      case GlobToken::STAR: {
+         if(token + 1 == end) return true;
+         const auto next = token + 1;
+         if(next->type == GlobToken::LITERAL) {
+            // Only try positions where the next literal occurs
+            for(auto pos = s.find(next->literal); pos != string_view::npos;
+                pos      = s.find(next->literal, pos + 1))
+               if(glob_match_tokens(next, end, s.substr(pos))) return true;
+            return false;
+         }
+         for(auto pos = 0u; pos <= s.size(); ++pos)
+            if(glob_match_tokens(next, end, s.substr(pos))) return true;
+         return false;
+      }
+
+      case GlobToken::GLOBSTAR:
+         if(glob_match_tokens(token + 1, end, s)) return true;
+         for(auto pos = s.find('/'); pos != string_view::npos;
+             pos      = s.find('/', pos + 1))
+            if(glob_match_tokens(token + 1, end, s.substr(pos + 1)))
+               return true;
+         return false;
+      }
+   }
+   return s.empty();
+}
+
+static bool glob_match(const Glob& glob, string_view s)
+{
+   auto has_prefix = [&]() {
+      return s.compare(0, glob.prefix.size(), glob.prefix) == 0;
+   };
+   auto has_suffix = [&]() { return ends_with(s, glob.suffix); };
+
+   switch(glob.kind) {
+   case Glob::EXACT: return s == glob.prefix;
+   case Glob::PREFIX: return has_prefix();
+   case Glob::SUFFIX: return has_suffix();
+   case Glob::PREFIX_SUFFIX:
+      return s.size() >= glob.prefix.size() + glob.suffix.size()
+             && has_prefix() && has_suffix();
+   case Glob::GENERAL:
+      if(s.size() < glob.prefix.size() + glob.suffix.size() || !has_prefix()
+         || !has_suffix())
+         return false;
+      s.remove_prefix(glob.prefix.size());
+      s.remove_suffix(glob.suffix.size());
+      return glob_match_tokens(
+          glob.tokens.data(), glob.tokens.data() + glob.tokens.size(), s);
+   case Glob::REGEX: return std::regex_match(s.begin(), s.end(), glob.regex);
+   }
+   return false;
+}
+
+// ------------------------------------------------------------------ glob-index
+
+// The extension (i.e., '.cpp') of a filename, or "" if it has none
+static string_view file_extension(string_view s)
+{
+   const auto pos = s.find_last_of("./");
+   if(pos == string_view::npos || s[pos] != '.') return {};
+   return s.substr(pos);
+}
+
+static GlobIndex make_glob_index(vector<const Glob*> globs)
+{
+   GlobIndex index;
+   index.globs = std::move(globs);
+
+   for(auto i = 0u; i < index.globs.size(); ++i) {
+      const auto& glob = *index.globs[i];
+
+      // A glob that ends with a literal can only match that literal's
+      // extension. (The regex fallback is opaque, and never bucketed.)
+      string_view literal = glob.kind == Glob::EXACT ? glob.prefix : glob.suffix;
+      if(glob.kind == Glob::REGEX) literal = {};
+      const auto ext = file_extension(literal);
+
+      if(ext.empty())
+         index.unbucketed.push_back(i);
+      else
+         index.by_extension[string(ext)].push_back(i);
+   }
+
+   return index;
+}
+
+// Calls 'f(ind)' with the candidate globs for 's', in their original order
+template<typename F>
+static bool glob_index_candidates(const GlobIndex& index, string_view s, F f)
+{
+   static const vector<uint32_t> no_bucket;
+
+   const auto ext = file_extension(s);
+   const auto ii  = ext.empty() ? index.by_extension.end()
+                               : index.by_extension.find(string(ext));
+   const auto& bucket = ii == index.by_extension.end() ? no_bucket : ii->second;
+
+   // Merge the two (sorted) lists of candidates
+   auto a = bucket.begin();
+   auto b = index.unbucketed.begin();
+   while(a != bucket.end() || b != index.unbucketed.end()) {
+      const bool take_a = b == index.unbucketed.end()
+                          || (a != bucket.end() && *a < *b);
+      const auto ind    = take_a ? *a++ : *b++;
+      ++index.n_evaluations;
+      if(index.globs[ind]->kind == Glob::REGEX) ++index.n_regex_evaluations;
+      if(f(ind)) return true;
+   }
+   return false;
+}
+
+static int glob_index_first_match(const GlobIndex& index, string_view s)
+{
+   int match = -1;
+   glob_index_candidates(index, s, [&](uint32_t ind) {
+      if(!glob_match(*index.globs[ind], s)) return false;
+      match = int(ind);
+      return true;
+   });
+   return match;
+}
+
+template<typename F>
+static void glob_index_for_each_match(const GlobIndex& index, string_view s, F f)
+{
+   glob_index_candidates(index, s, [&](uint32_t ind) {
+      if(glob_match(*index.globs[ind], s)) f(ind);
+      return false;
+   });
+}
+
+// ------------------------------------------------------------------ scan-cache
+
+static FileStamp make_stamp(const struct stat& st)
+{
+   FileStamp stamp;
+   stamp.dev        = uint64_t(st.st_dev);
+   stamp.ino        = uint64_t(st.st_ino);
+   stamp.size       = uint64_t(st.st_size);
+   stamp.mtime_sec  = int64_t(st.st_mtim.tv_sec);
+   stamp.mtime_nsec = int64_t(st.st_mtim.tv_nsec);
+   stamp.ctime_sec  = int64_t(st.st_ctim.tv_sec);
+   stamp.ctime_nsec = int64_t(st.st_ctim.tv_nsec);
+   return stamp;
+}
+
+// A default (all zeros) stamp if 'path' cannot be stat'd
+static FileStamp stat_stamp(const char* path)
+{
+   struct stat st;
+   return (stat(path, &st) == 0) ? make_stamp(st) : FileStamp{};
+}
+
+static bool operator==(const FileStamp& a, const FileStamp& b)
+{
+   return a.dev == b.dev && a.ino == b.ino && a.size == b.size
+          && a.mtime_sec == b.mtime_sec && a.mtime_nsec == b.mtime_nsec
+          && a.ctime_sec == b.ctime_sec && a.ctime_nsec == b.ctime_nsec;
+}
+
+static bool operator!=(const FileStamp& a, const FileStamp& b)
+{
+   return !(a == b);
+}
+
+// A directory modified within the last couple of seconds may be modified
+// again without its mtime changing, (timestamps are coarse), so we don't
+// trust such a listing until it has settled.
+static bool is_settled(const FileStamp& stamp, time_t now)
+{
+   return stamp.mtime_sec + 2 < now && stamp.ctime_sec + 2 < now;
+}
+
+static uint64_t dir_cache_key(const FileStamp& stamp)
+{
+   return stamp.dev * 0x9E3779B97F4A7C15ull ^ stamp.ino;
+}
+
+// ---------------------------------------------------------------------- hasher
+
+// 64-bit FNV-1a
+struct Hasher
+{
+   uint64_t hash = 14695981039346656037ull;
+
+   void add(string_view s)
+   {
+      for(auto c : s) hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+      hash = (hash ^ 0xff) * 1099511628211ull; // terminator
+   }
+};
+
+// ------------------------------------------------------------ load/save-cache
+
+static constexpr char k_cache_magic[] = "mobius-scan-cache-6";
+
+static void load_scan_cache(ScanCache& cache, const string& filename, FILE* err)
+{
+   std::ifstream fin(filename, std::ios::binary);
+   if(!fin.good()) return; // no cache yet
+   const string data((std::istreambuf_iterator<char>(fin)),
+                     std::istreambuf_iterator<char>());
+
+   size_t pos = 0;
+   auto read  = [&](void* dst, size_t n) {
+      if(pos + n > data.size()) throw std::runtime_error("truncated");
+      memcpy(dst, &data[pos], n);
+      pos += n;
+   };
+   auto read_u64 = [&]() {
+      uint64_t x;
+      read(&x, sizeof(x));
+      return x;
+   };
+   auto read_string = [&]() {
+      const auto len = read_u64();
+      if(pos + len > data.size()) throw std::runtime_error("truncated");
+      string s = data.substr(pos, len);
+      pos += len;
+      return s;
+   };
+   auto read_stamp = [&]() {
+      FileStamp stamp;
+      read(&stamp, sizeof(stamp));
+      return stamp;
+   };
+
+   try {
+      if(read_string() != k_cache_magic) return; // incompatible
+
+      ScanCache loaded;
+      for(auto n = read_u64(); n > 0; --n) {
+         ScanCache::Dir dir;
+         dir.stamp = read_stamp();
+         for(auto m = read_u64(); m > 0; --m) {
+            auto name = read_string();
+            dir.entries.emplace_back(std::move(name), read_u64() != 0);
+         }
+         const auto key = dir_cache_key(dir.stamp);
+         loaded.dirs.emplace(key, std::move(dir));
+      }
+
+      for(auto n = read_u64(); n > 0; --n) {
+         const auto key = read_u64();
+         ScanCache::Block block;
+         for(auto m = read_u64(); m > 0; --m) {
+            auto path = read_string();
+            block.inputs.emplace_back(std::move(path), read_stamp());
+         }
+         block.n_scanned = size_t(read_u64());
+         if(block.n_scanned > block.inputs.size())
+            throw std::runtime_error("bad block");
+         block.output = read_string();
+         for(auto m = read_u64(); m > 0; --m) {
+            auto variable = read_string();
+            block.variables.emplace_back(std::move(variable), read_string());
+         }
+         loaded.blocks.emplace(key, std::move(block));
+      }
+
+      for(auto n = read_u64(); n > 0; --n) {
+         auto path = read_string();
+         ScanCache::Module module;
+         module.stamp = read_stamp();
+         for(auto list : {&module.provided,
+                          &module.required,
+                          &module.header_units})
+            for(auto m = read_u64(); m > 0; --m)
+               list->push_back(read_string());
+         module.is_module_unit = (read_u64() != 0);
+         loaded.modules.emplace(std::move(path), std::move(module));
+      }
+
+      cache.dirs    = std::move(loaded.dirs);
+      cache.blocks  = std::move(loaded.blocks);
+      cache.modules = std::move(loaded.modules);
+   } catch(std::exception&) {
+      fprintf(err, "ignoring corrupt cache file '%s'\n", filename.c_str());
+   }
+}
+
+// Swaps the entries, but not the counters
+static void swap_scan_caches(ScanCache& a, ScanCache& b)
+{
+   std::swap(a.dirs, b.dirs);
+   std::swap(a.blocks, b.blocks);
+   std::swap(a.modules, b.modules);
+}
+
+// Saves only those entries used by this run, so that stale entries expire
+static void
+save_scan_cache(const ScanCache& cache, const string& filename, FILE* err)
+{
+   string data;
+   auto write     = [&](const void* src, size_t n) {
+      data.append(static_cast<const char*>(src), n);
+   };
+   auto write_u64 = [&](uint64_t x) { write(&x, sizeof(x)); };
+   auto write_string = [&](string_view s) {
+      write_u64(s.size());
+      data.append(s);
+   };
+   auto write_stamp = [&](const FileStamp& stamp) {
+      write(&stamp, sizeof(stamp));
+   };
+
+   write_string(k_cache_magic);
+
+   const auto n_dirs = std::count_if(
+       cbegin(cache.dirs), cend(cache.dirs), [](auto& o) { return o.second.used; });
+   write_u64(uint64_t(n_dirs));
+   for(const auto& [key, dir] : cache.dirs) {
+      if(!dir.used) continue;
+      write_stamp(dir.stamp);
+      write_u64(dir.entries.size());
+      for(const auto& [name, is_dir] : dir.entries) {
+         write_string(name);
+         write_u64(is_dir);
+      }
+   }
+
+   const auto n_blocks
+       = std::count_if(cbegin(cache.blocks), cend(cache.blocks), [](auto& o) {
+            return o.second.used;
+         });
+   write_u64(uint64_t(n_blocks));
+   for(const auto& [key, block] : cache.blocks) {
+      if(!block.used) continue;
+      write_u64(key);
+      write_u64(block.inputs.size());
+      for(const auto& [path, stamp] : block.inputs) {
+         write_string(path);
+         write_stamp(stamp);
+      }
+      write_u64(block.n_scanned);
+      write_string(block.output);
+      write_u64(block.variables.size());
+      for(const auto& [variable, value] : block.variables) {
+         write_string(variable);
+         write_string(value);
+      }
+   }
+
+   const auto n_modules
+       = std::count_if(cbegin(cache.modules), cend(cache.modules), [](auto& o) {
+            return o.second.used && o.second.settled;
+         });
+   write_u64(uint64_t(n_modules));
+   for(const auto& [path, module] : cache.modules) {
+      if(!module.used || !module.settled) continue;
+      write_string(path);
+      write_stamp(module.stamp);
+      for(auto list : {&module.provided,
+                       &module.required,
+                       &module.header_units}) {
+         write_u64(list->size());
+         for(const auto& name : *list) write_string(name);
+      }
+      write_u64(module.is_module_unit);
+   }
+
+   // Write atomically, so that an interrupted run never leaves a bad cache
+   const auto tmp_filename = filename + ".tmp" + std::to_string(getpid());
+   {
+      std::ofstream fout(tmp_filename, std::ios::binary);
+      fout.write(data.data(), std::streamsize(data.size()));
+      if(!fout.good()) {
+         unlink(tmp_filename.c_str());
+         fprintf(err, "failed to write cache file '%s'\n", filename.c_str());
+         return;
+      }
+   }
+   if(rename(tmp_filename.c_str(), filename.c_str()) != 0) {
+      unlink(tmp_filename.c_str());
+      fprintf(err, "failed to write cache file '%s'\n", filename.c_str());
+   }
+}
+
+// ------------------------------------------------------- scan-module-preamble
+
+// Finds the module declarations and imports at the top of a C++ source file,
+// skipping comments, string literals, and '#if 0' blocks. Scanning stops at
+// the first declaration that cannot be part of the module preamble.
+static void scan_module_preamble(string_view text, ScanCache::Module& module)
+{
+   const char* pos       = text.data();
+   const char* const end = pos + text.size();
+   bool at_line_start    = true; // only whitespace since the last newline
+
+   auto peek = [&](char c) { return pos < end && *pos == c; };
+   auto peek2 = [&](char c0, char c1) {
+      return pos + 1 < end && pos[0] == c0 && pos[1] == c1;
+   };
+   auto is_ident_char = [](char c) {
+      return std::isalnum(uint8_t(c)) || c == '_';
+   };
+
+   auto skip_block_comment = [&]() {
+      const auto ii = text.find("*/", size_t(pos + 2 - text.data()));
+      pos           = (ii == string_view::npos) ? end : text.data() + ii + 2;
+   };
+
+   // A '//' comment, to the end of the line (not consuming the '\n'),
+   // honouring splices
+   auto skip_line_comment = [&]() {
+      while(pos < end && *pos != '\n') pos += peek2('\\', '\n') ? 2 : 1;
+   };
+
+   // A string or character literal, or a header name if 'close' is '>'.
+   // None of these continue past the end of the line.
+   auto skip_quoted = [&](char close) {
+      ++pos;
+      while(pos < end && *pos != close && *pos != '\n')
+         pos += (*pos == '\\' && close != '>' && pos + 1 < end) ? 2 : 1;
+      if(peek(close)) ++pos;
+   };
+
+   // The rest of a directive or '#if 0' line (not consuming the '\n'). A '/*'
+   // inside a literal or header name is not a comment.
+   auto skip_line = [&](bool header_names) {
+      while(pos < end && *pos != '\n') {
+         if(peek2('\\', '\n'))
+            pos += 2;
+         else if(peek2('/', '/'))
+            skip_line_comment();
+         else if(peek2('/', '*'))
+            skip_block_comment();
+         else if(peek('"') || peek('\''))
+            skip_quoted(*pos);
+         else if(peek('<') && header_names)
+            skip_quoted('>');
+         else
+            ++pos;
+      }
+   };
+
+   auto skip_space = [&]() {
+      while(pos < end) {
+         const char c = *pos;
+         if(c == '\n') {
+            at_line_start = true;
+            ++pos;
+         } else if(c == ' ' || c == '\t' || c == '\r' || c == '\f'
+                   || c == '\v') {
+            ++pos;
+         } else if(peek2('\\', '\n')) {
+            pos += 2;
+         } else if(peek2('/', '/')) {
+            skip_line_comment();
+         } else if(peek2('/', '*')) {
+            skip_block_comment();
+         } else {
+            break;
+         }
+      }
+   };
+
+   auto skip_horizontal_space = [&]() {
+      while(pos < end && (*pos == ' ' || *pos == '\t')) ++pos;
+   };
+
+   auto read_identifier = [&]() {
+      const char* start = pos;
+      while(pos < end && is_ident_char(*pos)) ++pos;
+      return string_view(start, size_t(pos - start));
+   };
+
+   // i.e., 'std.core', where whitespace may appear around the '.'
+   auto read_module_name = [&]() {
+      string name;
+      for(;;) {
+         skip_space();
+         const auto part = read_identifier();
+         if(part.empty()) break;
+         name += part;
+         skip_space();
+         if(!peek('.')) break;
+         name += '.';
+         ++pos;
+      }
+      return name;
+   };
+
+   auto skip_past_semicolon = [&]() {
+      while(pos < end && *pos != ';') {
+         skip_space();
+         if(pos < end && *pos != ';') ++pos;
+      }
+      if(pos < end) ++pos;
+   };
+
+   // Skips a '#if 0' group, stopping after the matching '#else' or '#endif'
+   auto skip_if_0_group = [&]() {
+      int depth = 0;
+      while(pos < end) {
+         skip_line(false);
+         if(pos < end) ++pos; // '\n'
+         skip_horizontal_space();
+         if(!peek('#')) continue;
+         ++pos;
+         skip_horizontal_space();
+         const auto directive = read_identifier();
+         if(directive == "if" || directive == "ifdef" || directive == "ifndef") {
+            ++depth;
+         } else if(directive == "endif") {
+            if(depth-- == 0) break;
+         } else if(depth == 0 && (directive == "else" || directive == "elif")) {
+            break;
+         }
+      }
+      skip_line(false);
+   };
+
+   auto handle_directive = [&]() {
+      ++pos; // '#'
+      skip_horizontal_space();
+      const auto directive = read_identifier();
+      if(directive == "if") {
+         skip_horizontal_space();
+         if(peek('0') && !(pos + 1 < end && is_ident_char(pos[1]))) {
+            skip_if_0_group();
+            return;
+         }
+      }
+      skip_line(directive == "include" || directive == "include_next"
+                || directive == "import");
+   };
+
+   auto add = [](vector<string>& names, string name) {
+      if(std::find(cbegin(names), cend(names), name) == cend(names))
+         names.push_back(std::move(name));
+   };
+
+   string current_module; // for 'import :partition;'
+   int export_depth = 0;  // inside 'export { ... }'
+   bool is_export   = false;
+
+   for(;;) {
+      skip_space();
+      if(pos >= end) break;
+
+      if(*pos == '#' && at_line_start) {
+         handle_directive();
+         continue;
+      }
+      at_line_start = false;
+
+      if(peek(';')) {
+         ++pos;
+         is_export = false;
+         continue;
+      }
+      if(peek('{') && is_export) {
+         ++pos;
+         ++export_depth;
+         is_export = false;
+         continue;
+      }
+      if(peek('}') && export_depth > 0) {
+         ++pos;
+         --export_depth;
+         continue;
+      }
+
+      const auto word = read_identifier();
+      if(word == "export" && !is_export) {
+         is_export = true;
+         continue;
+      }
+
+      if(word == "module") {
+         skip_space();
+         if(peek(';')) { // global module fragment
+            ++pos;
+            is_export = false;
+            continue;
+         }
+         if(peek(':')) break; // 'module :private;'
+
+         auto name = read_module_name();
+         if(name.empty()) break;
+         skip_space();
+         string partition;
+         if(peek(':')) {
+            ++pos;
+            partition = read_module_name();
+         }
+
+         current_module        = name;
+         module.is_module_unit = true;
+         if(!partition.empty())
+            add(module.provided, name + ":" + partition);
+         else if(is_export)
+            add(module.provided, name);
+         else
+            add(module.required, name); // implementation unit
+
+         skip_past_semicolon();
+         is_export = false;
+         continue;
+      }
+
+      if(word == "import") {
+         skip_space();
+         if(peek('<') || peek('"')) { // header unit
+            const char close  = (*pos == '<') ? '>' : '"';
+            const char* start = pos++;
+            while(pos < end && *pos != close && *pos != '\n') ++pos;
+            if(peek(close)) ++pos;
+            add(module.header_units, string(start, size_t(pos - start)));
+         } else if(peek(':')) { // partition of the current module
+            ++pos;
+            const auto partition = read_module_name();
+            if(!partition.empty())
+               add(module.required, current_module + ":" + partition);
+         } else {
+            auto name = read_module_name();
+            if(name.empty()) break;
+            add(module.required, std::move(name));
+         }
+
+         skip_past_semicolon();
+         is_export = false;
+         continue;
+      }
+
+      break; // anything else ends the preamble
+   }
+
+   // A module never depends on itself
+   auto& required = module.required;
+   auto is_provided = [&](const auto& name) {
+      return std::find(cbegin(module.provided), cend(module.provided), name)
+             != cend(module.provided);
+   };
+   required.erase(std::remove_if(begin(required), std::end(required), is_provided),
+                  std::end(required));
+}
+
+// ------------------------------------------------------ scan-module-dependences
+
+// Returns the size of the file scanned
+static size_t scan_module_dependences(const string& fname,
+                                      ScanCache::Module& module)
+{
+   const int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+   if(fd < 0) return 0;
+
+   struct stat st;
+   if(fstat(fd, &st) != 0 || st.st_size == 0) {
+      close(fd);
+      return 0;
+   }
+
+   const auto size = size_t(st.st_size);
+   void* data      = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if(data == MAP_FAILED) return 0;
+
+   scan_module_preamble(string_view(static_cast<const char*>(data), size),
+                        module);
+   munmap(data, size);
+   return size;
+}
+
+// ---------------------------------------------------------------- parallel-for
+
+// Calls 'f(i)' for i in [0..n), on up to 'n_threads' threads (0 => all cores)
+template<typename F> static void parallel_for(size_t n, unsigned n_threads, F f)
+{
+   if(n_threads == 0)
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+   n_threads = unsigned(std::min<size_t>(n_threads, n));
+
+   std::atomic<size_t> counter{0};
+   auto worker = [&]() {
+      for(auto i = counter++; i < n; i = counter++) f(i);
+   };
+
+   vector<std::thread> threads;
+   for(auto i = 1u; i < n_threads; ++i) threads.emplace_back(worker);
+   worker();
+   for(auto& thread : threads) thread.join();
+}
+
+// ------------------------------------------------------- module-dependences
+
+// Rescans 'module' if 'fname' has changed. Threads may refresh different
+// modules at the same time.
+static void refresh_module(ScanCache& cache,
+                           const string& fname,
+                           ScanCache::Module& module)
+{
+   const auto stamp = stat_stamp(fname.c_str());
+   if(stamp != module.stamp) {
+      module       = ScanCache::Module{};
+      module.stamp = stamp;
+      cache.n_bytes_scanned += scan_module_dependences(fname, module);
+      ++cache.n_files_scanned;
+      module.settled = is_settled(stamp, time(nullptr));
+   }
+   module.used = true;
+}
+
+static const ScanCache::Module& module_dependences(ScanCache& cache,
+                                                   const string& fname)
+{
+   auto& module = cache.modules[fname];
+   if(!module.used) refresh_module(cache, fname, module);
+   return module;
+}
+
+// Scans many files in parallel, so that later calls to 'module_dependences'
+// (which must be in order, for deterministic output) find them memoized.
+static void prescan_module_dependences(ScanCache& cache,
+                                       const vector<string>& fnames,
+                                       unsigned n_threads)
+{
+   // Find (or create) each file's entry here, since the map is not
+   // thread-safe; references to entries are stable. A path given twice is
+   // scanned once, since two threads must never refresh one entry.
+   vector<std::pair<const string*, ScanCache::Module*>> work;
+   std::unordered_set<const ScanCache::Module*> queued;
+   for(const auto& fname : fnames) {
+      auto& module = cache.modules[fname];
+      if(!module.used && queued.insert(&module).second)
+         work.emplace_back(&fname, &module);
+   }
+
+   parallel_for(work.size(), n_threads, [&](size_t i) {
+      auto& [fname, module] = work[i];
+      if(!module->used) refresh_module(cache, *fname, *module);
+   });
+}
+
+// ------------------------------------------------------------------- src-path
+
+// 'fname' is relative to the current +src block's 'cd' directory
+static string src_path(const State& state, string_view fname)
+{
+   return (state.cd_dir.empty() || fname.front() == '/')
+              ? string(fname)
+              : state.cd_dir + "/" + string(fname);
+}
+
+// A path relative to the working directory, made absolute
+static string absolute_path(const State& state, const string& path)
+{
+   return (path.empty() || path.front() != '/')
+              ? state.current_working_directory + "/" + path
+              : path;
+}
+
+// ------------------------------------------------ calculate-module-dependences
+
+static void calculate_module_dependences(State& state,
+                                         string_view fname,
+                                         OutputBuffer& out)
+{
+   const string_view modules_dir = state.opts.module_dir;
+
+   // Partitions are prebuilt as 'module-partition.pcm'
+   int counter             = 0;
+   auto process_dependency = [&](const string& module) {
+      if(counter++ > 0) out << ' ';
+      out << modules_dir
+          << (modules_dir.size() > 0 and modules_dir.back() != '/' ? "/" : "");
+      for(auto c : module) out << (c == ':' ? '-' : c);
+      out << ".pcm";
+   };
+
+   PhaseTimer timer(state.profile, Profile::SCAN, false); // too many to trace
+   if(state.unity_sources.empty()) {
+      for(const auto& module : source_module(state, fname).required)
+         process_dependency(module);
+      return;
+   }
+
+   // A unity file requires whatever its sources do
+   vector<const string*> required;
+   for(const auto source : state.unity_sources)
+      for(const auto& module : source_module(state, source).required)
+         if(std::none_of(cbegin(required), cend(required), [&](auto o) {
+               return *o == module;
+            }))
+            required.push_back(&module);
+   for(const auto module : required) process_dependency(*module);
+}
+
+// The modules of a source file (which the +src block then depends on, once,
+// however often it asks)
+static const ScanCache::Module& source_module(State& state, string_view fname)
+{
+   const auto path = src_path(state, fname);
+   if(state.scanned_set.insert(path).second) state.scanned_files.push_back(path);
+   const auto shared = find_shared_module(state, path);
+   return shared ? *shared : module_dependences(state.cache, path);
+}
+
+// -------------------------------------------------------------- check-modules
+
+// Indexes the modules that the files scanned for '?', by every +src block,
+// provide and import. Modules that nothing provides (perhaps prebuilt) are
+// warnings; modules with several providers, and import cycles, are errors,
+// since the build could not succeed. With --module-depth, also prints the
+// longest chain of imports, which the build must compile one at a time.
+static void check_modules(State& state)
+{
+   struct Node
+   {
+      vector<const string*> providers; // files
+      vector<const string*> importers; // files
+      vector<string_view> imports;     // what the providers import
+      int depth{0}; // the longest chain of imports from here; -1 if visiting
+   };
+
+   // -- Index the modules. A file that several +src blocks found (by any
+   //    path) is only counted once. The files of cached +src blocks are
+   //    (almost always) memoized already.
+   unordered_map<string_view, Node> nodes;
+   std::set<std::pair<uint64_t, uint64_t>> seen; // (dev, inode)
+   for(const auto& path : state.module_files) {
+      const auto shared  = find_shared_module(state, path);
+      const auto& module
+          = shared ? *shared : module_dependences(state.cache, path);
+      if(!seen.insert({module.stamp.dev, module.stamp.ino}).second) continue;
+      for(const auto& name : module.provided) {
+         auto& node = nodes[name];
+         node.providers.push_back(&path);
+         node.imports.insert(
+             end(node.imports), cbegin(module.required), cend(module.required));
+      }
+      for(const auto& name : module.required)
+         nodes[name].importers.push_back(&path);
+   }
+
+   vector<string_view> names;
+   for(const auto& [name, node] : nodes) names.push_back(name);
+   std::sort(begin(names), end(names));
+
+   // -- Missing and duplicate providers
+   FILE* fp        = state.err;
+   size_t n_errors = 0;
+   for(const auto name : names) {
+      const auto& node = nodes.at(name);
+      const auto s     = string(name);
+      if(node.providers.empty()) {
+         const auto n_others = node.importers.size() - 1;
+         string others;
+         if(n_others > 0)
+            others = " (and " + std::to_string(n_others)
+                     + (n_others == 1 ? " other)" : " others)");
+         fprintf(fp,
+                 "warning: module '%s' is imported by '%s'%s, but no file "
+                 "scanned for '?' provides it\n",
+                 s.c_str(),
+                 node.importers.front()->c_str(),
+                 others.c_str());
+      } else if(node.providers.size() > 1) {
+         string files;
+         for(const auto path : node.providers)
+            files += (files.empty() ? "'" : ", '") + *path + "'";
+         fprintf(fp,
+                 "error: module '%s' is provided by more than one file: %s\n",
+                 s.c_str(),
+                 files.c_str());
+         ++n_errors;
+      }
+   }
+
+   // -- Cycles, and the depth of each module, depth first
+   vector<string_view> stack;
+   std::function<int(string_view)> depth_of = [&](string_view name) -> int {
+      auto& node = nodes.at(name);
+      if(node.depth < 0) {
+         string cycle;
+         const auto ii = std::find(begin(stack), end(stack), name);
+         for(auto jj = ii; jj != end(stack); ++jj)
+            cycle.append(*jj).append(" -> ");
+         cycle.append(name);
+         fprintf(fp, "error: modules import each other: %s\n", cycle.c_str());
+         ++n_errors;
+         return 0;
+      }
+      if(node.depth > 0) return node.depth;
+
+      node.depth = -1;
+      stack.push_back(name);
+      int depth = 0;
+      for(const auto import : node.imports)
+         depth = std::max(depth, depth_of(import));
+      stack.pop_back();
+      node.depth = depth + 1;
+      return node.depth;
+   };
+   for(const auto name : names) depth_of(name);
+
+   if(n_errors > 0)
+      throw std::runtime_error("--check-modules found "
+                               + std::to_string(n_errors) + " error"
+                               + (n_errors == 1 ? "" : "s"));
+
+   // -- The longest chain, from the first of the deepest modules
+   if(!state.opts.module_depth || names.empty()) return;
+   auto name = *std::max_element(
+       cbegin(names), cend(names), [&](auto a, auto b) {
+          return nodes.at(a).depth < nodes.at(b).depth;
+       });
+   const auto max_depth = nodes.at(name).depth;
+   string chain(name);
+   for(auto depth = max_depth; depth > 1; --depth) {
+      const auto& imports = nodes.at(name).imports;
+      name = *std::find_if(cbegin(imports), cend(imports), [&](auto o) {
+         return nodes.at(o).depth == depth - 1;
+      });
+      chain.append(" -> ").append(name);
+   }
+   fprintf(fp,
+           "module depth %d, of %zu modules: %s\n",
+           max_depth,
+           names.size(),
+           chain.c_str());
+}
+
+// ---------------------------------------------------- compile-command-template
+
+static CommandTemplate compile_command_template(const string& s)
+{
+   CommandTemplate chunks;
+   auto push = [&](CommandChunk::Kind kind) {
+      chunks.emplace_back();
+      chunks.back().kind = kind;
+   };
+
+   for(auto c : s) {
+      switch(c) {
+      case '^': push(CommandChunk::FILENAME); break;
+      case '%': push(CommandChunk::EXTLESS); break;
+      case '@': push(CommandChunk::DIRNAME); break;
+      case '#': push(CommandChunk::DOTTED); break;
+      case '&': push(CommandChunk::BASENAME); break;
+      case '?': push(CommandChunk::MODULES); break;
+      case '!': break;
+      default:
+         if(chunks.empty() || chunks.back().kind != CommandChunk::LITERAL)
+            push(CommandChunk::LITERAL);
+         chunks.back().text += c;
+      }
+   }
+   return chunks;
+}
+
+// ----------------------------------------------------------------- path-pieces
+
+namespace
+{
+// The parts of a matched filename that commands substitute
+struct PathPieces
+{
+   string_view fname;    // without any leading './'
+   string_view extless;  // 'fname' without its extension
+   string_view dirname;  // as dirname(3)
+   string_view basename; // as basename(3), so including the extension
+   string_view dotted;   // 'extless' without the search directory
+};
+} // namespace
+
+static PathPieces make_path_pieces(string_view fname, string_view dname)
+{
+   PathPieces pieces;
+
+   // Remove leading './' if it is there
+   string_view fnamev = fname;
+   if(fnamev.size() > 2 && fnamev[0] == '.' && fnamev[1] == '/')
+      fnamev.remove_prefix(2);
+   pieces.fname = fnamev;
+
+   // The extensionless version
+   pieces.extless = fnamev;
+   for(auto i = fnamev.size(); i > 0; --i) {
+      if(fnamev[i - 1] == '/') break;
+      if(fnamev[i - 1] == '.') {
+         pieces.extless = fnamev.substr(0, i - 1);
+         break;
+      }
+   }
+
+   // dirname(3) and basename(3), which ignore trailing slashes
+   string_view trimmed = fnamev;
+   while(trimmed.size() > 1 && trimmed.back() == '/') trimmed.remove_suffix(1);
+   const auto slash = trimmed.rfind('/');
+   if(trimmed.empty()) {
+      pieces.dirname = pieces.basename = ".";
+   } else if(trimmed == "/") {
+      pieces.dirname  = (fnamev == "//") ? fnamev : trimmed;
+      pieces.basename = trimmed;
+   } else if(slash == string_view::npos) {
+      pieces.dirname  = ".";
+      pieces.basename = trimmed;
+   } else {
+      pieces.basename = trimmed.substr(slash + 1);
+      auto end = slash;
+      while(end > 0 && trimmed[end - 1] == '/') --end;
+      if(end > 0)
+         pieces.dirname = trimmed.substr(0, end);
+      else if(slash == 1)
+         pieces.dirname = "//";
+      else
+         pieces.dirname = "/";
+   }
+
+   // Without the search directory
+   size_t pos = 0;
+   if(pieces.extless.size() > dname.size()) {
+      pos = dname.size();
+      if(pieces.extless[pos] == '/') ++pos;
+   }
+   pieces.dotted = pieces.extless.substr(pos);
+
+   return pieces;
+}
+
+// ---------------------------------------------------------- command-substitute
+
+static void command_substitute(State& state,
+                               OutputBuffer& cmd_out,
+                               string_view fname,
+                               const string_view dname,
+                               const FileCommand& cmd,
+                               vector<FilterVariable>& filters,
+                               const GlobIndex& filter_index)
+{
+   // substitute:
+   //    '^' for fname
+   //    '%' for the filename without extension
+   //    '#' same as '%', but without the search directory, and '/' => '.'
+   //    '@' for dirname(fname)
+   //    '&' for basename(fname)
+   // remove all '!', but...
+   // if a '!' exists, then add that product to the list of files in state
+   const auto pieces = make_path_pieces(fname, dname);
+
+   // Output the command
+   auto expand = [&](const CommandTemplate& chunks, OutputBuffer& out) {
+      for(const auto& chunk : chunks) {
+         switch(chunk.kind) {
+         case CommandChunk::LITERAL: out << chunk.text; break;
+         case CommandChunk::FILENAME: out << pieces.fname; break;
+         case CommandChunk::EXTLESS: out << pieces.extless; break;
+         case CommandChunk::DIRNAME: out << pieces.dirname; break;
+         case CommandChunk::BASENAME: out << pieces.basename; break;
+         case CommandChunk::DOTTED: {
+            auto dotted = pieces.dotted;
+            for(auto pos = dotted.find('/'); pos != string_view::npos;
+                pos      = dotted.find('/')) {
+               out << dotted.substr(0, pos) << '.';
+               dotted.remove_prefix(pos + 1);
+            }
+            out << dotted;
+         } break;
+         case CommandChunk::MODULES:
+            if(state.dyndep_prefix.empty())
+               calculate_module_dependences(state, fname, out);
+            break;
+         }
+      }
+   };
+
+   if(cmd.scans_modules && !state.dyndep_prefix.empty()) {
+      // With --dyndep, '?' is an edge that scans the file when building,
+      // and the block's dyndep file
+      auto& scratch = state.scratch;
+      scratch.buffer.clear();
+      expand(cmd.primary_template, scratch);
+      auto scan = state.dyndep_prefix + "/";
+      scan.append(pieces.fname).append(".ddi");
+      cmd_out << "build " << scan << ": mobius_scan " << pieces.fname
+              << "\n   primary_output = " << scratch.buffer << '\n';
+      state.dyndep_scans.push_back(std::move(scan));
+
+      // Drop the (now empty) implicit dependences that '?' left
+      scratch.buffer.clear();
+      expand(cmd.head_template, scratch);
+      string_view head = scratch.buffer;
+      auto rtrim_view  = [&]() {
+         while(!head.empty() && std::isspace(head.back())) head.remove_suffix(1);
+      };
+      rtrim_view();
+      if(head.size() > 1 && head.back() == '|' && head[head.size() - 2] != '|') {
+         head.remove_suffix(1);
+         rtrim_view();
+      }
+
+      const auto dyndep = state.dyndep_prefix + ".dd";
+      cmd_out << head
+              << (head.find("||") == string_view::npos ? " || " : " ")
+              << dyndep << "\n   dyndep = " << dyndep;
+      expand(cmd.tail_template, cmd_out);
+   } else {
+      expand(cmd.command_template, cmd_out);
+   }
+
+   // Outputs are interned, if a filter wants them
+   auto handle_output = [&](string_view s, bool re_add) {
+      auto id = PathTable::k_none;
+      glob_index_for_each_match(filter_index, s, [&](auto ind) {
+         if(id == PathTable::k_none) id = intern_path(state.paths, s);
+         filters[ind].products.push_back(id);
+      });
+      if(re_add) {
+         if(id == PathTable::k_none) id = intern_path(state.paths, s);
+         state.additional_files.push_back(id);
+      }
+   };
+
+   // And add in the outputs with '!' on them
+   auto& scratch = state.scratch;
+   for(const auto& chunks : cmd.re_add_templates) {
+      scratch.buffer.clear();
+      expand(chunks, scratch);
+      handle_output(scratch.buffer, true);
+   }
+
+   for(const auto& chunks : cmd.other_templates) {
+      scratch.buffer.clear();
+      expand(chunks, scratch);
+      handle_output(scratch.buffer, false);
+   }
+
+   cmd_out << '\n';
+}
+
+// ------------------------------------------------------------------ path-table
+
+static void clear_path_table(PathTable& table)
+{
+   table.entries.clear();
+   table.chunks.clear();
+   table.chunk_used = table.chunk_size = 0;
+}
+
+// Space for 'size' bytes in the arena
+static char* allocate_path(PathTable& table, size_t size)
+{
+   if(table.chunks.empty() || table.chunk_used + size > table.chunk_size) {
+      table.chunk_size = std::max(PathTable::k_chunk_size, size);
+      table.chunks.emplace_back(new char[table.chunk_size]);
+      table.chunk_used = 0;
+   }
+   auto data = table.chunks.back().get() + table.chunk_used;
+   table.chunk_used += size;
+   return data;
+}
+
+static PathTable::Id add_path_entry(PathTable& table,
+                                    const char* path,
+                                    size_t size,
+                                    size_t name_pos,
+                                    PathTable::Id parent,
+                                    PathTable::Id root)
+{
+   table.entries.push_back(
+       {path, uint32_t(size), uint32_t(name_pos), parent, root});
+   return PathTable::Id(table.entries.size() - 1);
+}
+
+static PathTable::Id intern_path(PathTable& table,
+                                 string_view path,
+                                 PathTable::Id parent,
+                                 PathTable::Id root)
+{
+   auto data = allocate_path(table, path.size());
+   std::copy(cbegin(path), cend(path), data);
+   const auto slash = path.rfind('/');
+   return add_path_entry(table,
+                         data,
+                         path.size(),
+                         (slash == string_view::npos) ? 0 : slash + 1,
+                         parent,
+                         root);
+}
+
+// Interns 'parent/name', where the parent is a directory in the table
+static PathTable::Id
+intern_child(PathTable& table, PathTable::Id parent, string_view name)
+{
+   const auto dir   = path_view(table, parent);
+   const auto root  = table.entries[parent].root;
+   const bool slash = dir.empty() || dir.back() != '/';
+   const auto size  = dir.size() + (slash ? 1 : 0) + name.size();
+
+   auto data = allocate_path(table, size);
+   std::copy(cbegin(dir), cend(dir), data);
+   if(slash) data[dir.size()] = '/';
+   std::copy(cbegin(name), cend(name), data + size - name.size());
+   return add_path_entry(
+       table, data, size, size - name.size(), parent, root);
+}
+
+static string_view path_view(const PathTable& table, PathTable::Id id)
+{
+   const auto& entry = table.entries[id];
+   return string_view(entry.path, entry.size);
+}
+
+// ------------------------------------------------------------ walk-directories
+
+namespace
+{
+struct linux_dirent64
+{
+   ino64_t d_ino;
+   off64_t d_off;
+   unsigned short d_reclen;
+   unsigned char d_type;
+   char d_name[1]; // actually 'd_reclen - 19' bytes, nul terminated
+};
+
+// The patterns of one ignore file (in '.gitignore' format), which take
+// precedence over the ignore files of the directories above it
+struct IgnoreRules
+{
+   struct Pattern
+   {
+      string text;               // without any '!', or trailing '/'
+      vector<string> components; // split on '/', if anchored to the file
+      bool negated{false};       // '!pattern' re-includes what it matches
+      bool dir_only{false};      // 'pattern/' only matches directories
+   };
+
+   std::shared_ptr<const IgnoreRules> parent;
+   size_t base_size{0}; // paths are matched relative to the file, from here
+   vector<Pattern> patterns;
+};
+
+struct WalkNode
+{
+   struct Entry
+   {
+      string name;
+      std::unique_ptr<WalkNode> dir; // nullptr for regular files
+      bool skipped{false};           // by the walk's filter
+   };
+
+   string path;           // starts with the walk's base directory, if any
+   size_t base_size{0};   // of the base directory, in 'path'
+   vector<Entry> entries; // sorted by name, once listed
+   FileStamp stamp;       // (dev, inode) identifies the directory
+   std::shared_ptr<const IgnoreRules> ignore; // rules for the entries
+   vector<string> ignore_files;               // read to get 'ignore'
+   bool listed{false}; // false if the walk reached it another way first
+   bool from_cache{false};
+};
+
+struct WalkQueue
+{
+   std::mutex padlock;
+   std::deque<WalkNode*> nodes;
+};
+
+struct Walker
+{
+   vector<WalkQueue> queues;
+   std::atomic<size_t> queued{0};  // nodes sitting in a queue
+   std::atomic<size_t> pending{0}; // nodes not yet listed
+   std::mutex padlock;             // for 'idle' and 'error'
+   std::condition_variable idle;
+   string error;
+
+   std::mutex claim_padlock; // for 'claimed'
+   std::set<std::pair<uint64_t, uint64_t>> claimed; // (dev, inode) listed
+
+   const WalkFilter* filter{nullptr};
+   const ScanCache* cache{nullptr}; // read-only while walking
+   time_t start{0};
+};
+} // namespace
+
+static void add_subdirectory(WalkNode& node, const char* name)
+{
+   node.entries.push_back({string(name), std::make_unique<WalkNode>()});
+   auto& dir = *node.entries.back().dir;
+   dir.path.reserve(node.path.size() + 1 + strlen(name));
+   dir.path = node.path;
+   if(dir.path.empty() || dir.path.back() != '/') dir.path += '/';
+   dir.path += name;
+   dir.base_size = node.base_size;
+}
+
+static std::shared_ptr<const IgnoreRules>
+read_ignore_file(const WalkNode& node, const string& filename)
+{
+   InputReader in;
+   if(!open_input(in, filename))
+      throw std::runtime_error("failed to open ignore file: '" + filename
+                               + "': " + strerror(errno));
+
+   const auto dir   = string_view(node.path).substr(node.base_size);
+   auto rules       = std::make_shared<IgnoreRules>();
+   rules->parent    = node.ignore;
+   rules->base_size = dir.size();
+   if(dir.empty() || dir.back() != '/') ++rules->base_size;
+
+   string_view line;
+   while(read_line(in, line)) {
+      string s(line);
+      if(!s.empty() && s.back() == '\r') s.pop_back();
+      while(!s.empty() && s.back() == ' '
+            && !(s.size() > 1 && s[s.size() - 2] == '\\'))
+         s.pop_back(); // trailing spaces, unless escaped
+      if(s.empty() || s[0] == '#') continue;
+
+      IgnoreRules::Pattern pattern;
+      pattern.negated = (s[0] == '!');
+      if(pattern.negated) s.erase(0, 1);
+      pattern.dir_only = (!s.empty() && s.back() == '/');
+      if(pattern.dir_only) s.pop_back();
+      if(s.empty()) continue;
+
+      // A pattern with a '/' is anchored to the ignore file's directory;
+      // otherwise it matches a name at any depth
+      if(s.find('/') != string::npos) {
+         for(auto pos = (s[0] == '/') ? 1u : 0u;;) {
+            const auto next = s.find('/', pos);
+            pattern.components.push_back(s.substr(pos, next - pos));
+            if(next == string::npos) break;
+            pos = next + 1;
+         }
+      }
+      pattern.text = std::move(s);
+      rules->patterns.push_back(std::move(pattern));
+   }
+   return rules;
+}
+
+// Matches each component of 'path' with fnmatch, where '**' matches any
+// number of directories
+static bool match_ignore_components(const string* component,
+                                    const string* end,
+                                    string_view path)
+{
+   string name;
+   for(; component != end; ++component) {
+      if(*component == "**") {
+         if(component + 1 == end) return !path.empty(); // everything inside
+         for(;;) {
+            if(match_ignore_components(component + 1, end, path)) return true;
+            const auto pos = path.find('/');
+            if(pos == string_view::npos) return false;
+            path.remove_prefix(pos + 1);
+         }
+      }
+      if(path.empty()) return false;
+      const auto pos = path.find('/');
+      name           = path.substr(0, pos);
+      if(fnmatch(component->c_str(), name.c_str(), 0) != 0) return false;
+      path = (pos == string_view::npos) ? string_view{} : path.substr(pos + 1);
+   }
+   return path.empty();
+}
+
+// The last pattern to match, in the deepest ignore file, decides
+static bool is_ignored(const IgnoreRules* rules,
+                       string_view path,
+                       const string& name,
+                       bool is_dir)
+{
+   for(; rules != nullptr; rules = rules->parent.get()) {
+      const auto relative = path.substr(rules->base_size);
+      for(auto ii = rules->patterns.rbegin(); ii != rules->patterns.rend();
+          ++ii) {
+         if(ii->dir_only && !is_dir) continue;
+         const bool matches
+             = ii->components.empty()
+                   ? fnmatch(ii->text.c_str(), name.c_str(), 0) == 0
+                   : match_ignore_components(
+                       ii->components.data(),
+                       ii->components.data() + ii->components.size(),
+                       relative);
+         if(matches) return !ii->negated;
+      }
+   }
+   return false;
+}
+
+static bool is_excluded(const WalkFilter& filter, string_view path)
+{
+   return std::any_of(cbegin(filter.excludes),
+                      cend(filter.excludes),
+                      [&](const Glob& glob) { return glob_match(glob, path); });
+}
+
+// Whether anything below 'dir' (which ends in '/') could match a rule
+static bool could_match_rules(const WalkFilter& filter, string_view dir)
+{
+   if(!filter.prune_by_rules) return true;
+   return std::any_of(cbegin(filter.rule_prefixes),
+                      cend(filter.rule_prefixes),
+                      [&](string_view prefix) {
+                         const auto n = std::min(prefix.size(), dir.size());
+                         return prefix.substr(0, n) == dir.substr(0, n);
+                      });
+}
+
+// Reads the directory's ignore files, and marks the entries to skip
+static void filter_entries(const WalkFilter& filter, WalkNode& node)
+{
+   if(filter.excludes.empty() && filter.ignore_files.empty()
+      && !filter.prune_by_rules)
+      return;
+
+   // Paths as the rules see them, without the base directory
+   string path = node.path.substr(node.base_size);
+   if(path.empty() || path.back() != '/') path += '/';
+   const auto base_size = path.size();
+
+   for(const auto& name : filter.ignore_files) {
+      const auto ii = std::lower_bound(
+          begin(node.entries), end(node.entries), name, [](auto& entry, auto& s) {
+             return entry.name < s;
+          });
+      if(ii == end(node.entries) || ii->name != name || ii->dir) continue;
+      auto filename = node.path;
+      if(filename.back() != '/') filename += '/';
+      node.ignore_files.push_back(filename + name);
+      node.ignore = read_ignore_file(node, node.ignore_files.back());
+   }
+
+   for(auto& entry : node.entries) {
+      path.resize(base_size);
+      path += entry.name;
+      const auto ignore = node.ignore.get();
+      if(entry.dir) {
+         // A directory is excluded with, or without, a trailing '/'
+         path += '/';
+         const auto dir_path = string_view(path);
+         const auto dir_name = dir_path.substr(0, dir_path.size() - 1);
+         entry.skipped       = is_excluded(filter, dir_name)
+                         || is_excluded(filter, dir_path)
+                         || is_ignored(ignore, dir_name, entry.name, true)
+                         || !could_match_rules(filter, dir_path);
+         if(!entry.skipped) entry.dir->ignore = node.ignore;
+      } else {
+         entry.skipped = is_excluded(filter, path)
+                         || is_ignored(ignore, path, entry.name, false);
+      }
+   }
+}
+
+// Claims a directory, by (dev, inode), unless it has already been reached
+// another way (i.e., through a symlink, or a cycle of them)
+static bool claim_directory(Walker& walker, WalkNode& node)
+{
+   node.stamp = stat_stamp(node.path.c_str());
+   std::lock_guard<std::mutex> lock(walker.claim_padlock);
+   return walker.claimed.emplace(node.stamp.dev, node.stamp.ino).second;
+}
+
+static void list_directory(const Walker& walker, WalkNode& node)
+{
+   node.listed = true;
+
+   // Use the cached listing if the directory is unchanged
+   const auto cache = walker.cache;
+   if(cache != nullptr) {
+      const auto ii = cache->dirs.find(dir_cache_key(node.stamp));
+      if(ii != cache->dirs.end() && ii->second.stamp == node.stamp) {
+         for(const auto& [name, is_dir] : ii->second.entries) {
+            if(is_dir)
+               add_subdirectory(node, name.c_str());
+            else
+               node.entries.push_back({name, nullptr});
+         }
+         node.from_cache = true;
+         filter_entries(*walker.filter, node);
+         return;
+      }
+   }
+
+   const int fd = open(node.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+   if(fd < 0)
+      throw std::runtime_error("failed to open directory: '" + node.path
+                               + "': " + strerror(errno));
+
+   if(cache != nullptr) {
+      struct stat st;
+      if(fstat(fd, &st) == 0) node.stamp = make_stamp(st);
+   }
+
+   alignas(linux_dirent64) char buffer[32 * 1024];
+   for(;;) {
+      const auto n = syscall(SYS_getdents64, fd, buffer, sizeof(buffer));
+      if(n < 0) {
+         const auto err = errno;
+         close(fd);
+         throw std::runtime_error("failed to read directory: '" + node.path
+                                  + "': " + strerror(err));
+      }
+      if(n == 0) break;
+
+      for(long pos = 0; pos < n;) {
+         const auto dirent = reinterpret_cast<linux_dirent64*>(buffer + pos);
+         pos += dirent->d_reclen;
+
+         const char* name = dirent->d_name;
+         if(name[0] == '.'
+            && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+            continue;
+
+         // Only 'stat' when the directory entry doesn't tell us the type.
+         // Symlinks are followed, so that we find what they point to.
+         auto type = dirent->d_type;
+         if(type == DT_UNKNOWN || type == DT_LNK) {
+            struct stat st;
+            if(fstatat(fd, name, &st, 0) != 0) continue; // i.e., broken link
+            type = S_ISDIR(st.st_mode)   ? DT_DIR
+                   : S_ISREG(st.st_mode) ? DT_REG
+                                         : DT_UNKNOWN;
+         }
+
+         if(type == DT_REG) {
+            node.entries.push_back({string(name), nullptr});
+         } else if(type == DT_DIR) {
+            add_subdirectory(node, name);
+         }
+      }
+   }
+   close(fd);
+
+   std::sort(begin(node.entries), end(node.entries), [](auto& a, auto& b) {
+      return a.name < b.name;
+   });
+   filter_entries(*walker.filter, node);
+}
+
+static void walk_worker(Walker& walker, unsigned id)
+{
+   const auto n_queues = unsigned(walker.queues.size());
+
+   auto pop = [&]() -> WalkNode* {
+      // Work depth-first from the back of our own queue...
+      {
+         auto& queue = walker.queues[id];
+         std::lock_guard<std::mutex> lock(queue.padlock);
+         if(!queue.nodes.empty()) {
+            auto node = queue.nodes.back();
+            queue.nodes.pop_back();
+            return node;
+         }
+      }
+      // ...and steal from the front of everybody else's
+      for(auto i = 1u; i < n_queues; ++i) {
+         auto& queue = walker.queues[(id + i) % n_queues];
+         std::lock_guard<std::mutex> lock(queue.padlock);
+         if(!queue.nodes.empty()) {
+            auto node = queue.nodes.front();
+            queue.nodes.pop_front();
+            return node;
+         }
+      }
+      return nullptr;
+   };
+
+   auto notify = [&]() {
+      { std::lock_guard<std::mutex> lock(walker.padlock); }
+      walker.idle.notify_all();
+   };
+
+   for(;;) {
+      auto node = pop();
+      if(node == nullptr) {
+         std::unique_lock<std::mutex> lock(walker.padlock);
+         walker.idle.wait(lock, [&]() {
+            return walker.queued.load() > 0 || walker.pending.load() == 0;
+         });
+         if(walker.pending.load() == 0) return;
+         continue;
+      }
+      --walker.queued;
+
+      try {
+         if(claim_directory(walker, *node)) list_directory(walker, *node);
+      } catch(std::exception& e) {
+         std::lock_guard<std::mutex> lock(walker.padlock);
+         if(walker.error.empty()) walker.error = e.what();
+         node->entries.clear();
+      }
+
+      // Queue up the subdirectories
+      size_t n_dirs = 0;
+      {
+         auto& queue = walker.queues[id];
+         std::lock_guard<std::mutex> lock(queue.padlock);
+         for(auto& entry : node->entries) {
+            if(!entry.dir || entry.skipped) continue;
+            queue.nodes.push_back(entry.dir.get());
+            ++n_dirs;
+         }
+      }
+      if(n_dirs > 0) {
+         walker.pending += n_dirs;
+         walker.queued += n_dirs;
+         notify();
+      }
+
+      if(--walker.pending == 0) notify();
+   }
+}
+
+static void walk_directories(string_view base,
+                             const vector<string>& roots,
+                             const WalkFilter& filter,
+                             unsigned n_threads,
+                             ScanCache* cache,
+                             PathTable& paths,
+                             vector<PathTable::Id>& files,
+                             vector<string>* listed,
+                             vector<string>* read)
+{
+   if(n_threads == 0)
+      n_threads = std::max(1u, std::thread::hardware_concurrency());
+
+   // ---- List all the directories, in parallel
+   vector<WalkNode> nodes(roots.size());
+   Walker walker;
+   walker.queues = vector<WalkQueue>(n_threads);
+   for(auto i = 0u; i < roots.size(); ++i) {
+      if(!base.empty() && roots[i].front() != '/') {
+         nodes[i].path      = string(base) + "/";
+         nodes[i].base_size = nodes[i].path.size();
+      }
+      nodes[i].path += roots[i];
+      walker.queues[i % n_threads].nodes.push_back(&nodes[i]);
+   }
+   walker.pending = walker.queued = roots.size();
+   walker.filter                   = &filter;
+   walker.cache                    = cache;
+   walker.start                    = time(nullptr);
+
+   vector<std::thread> threads;
+   for(auto i = 1u; i < n_threads; ++i)
+      threads.emplace_back(walk_worker, std::ref(walker), i);
+   walk_worker(walker, 0);
+   for(auto& thread : threads) thread.join();
+
+   if(!walker.error.empty()) throw std::runtime_error(walker.error);
+
+   // ---- Update the cache with the new (and settled) listings
+   auto update_cache = [&](const WalkNode& node) {
+      if(node.from_cache) {
+         cache->dirs[dir_cache_key(node.stamp)].used = true;
+      } else if(is_settled(node.stamp, walker.start)) {
+         auto& dir = cache->dirs[dir_cache_key(node.stamp)];
+         dir.stamp = node.stamp;
+         dir.used  = true;
+         dir.entries.clear();
+         dir.entries.reserve(node.entries.size());
+         for(const auto& entry : node.entries)
+            dir.entries.emplace_back(entry.name, entry.dir != nullptr);
+      }
+   };
+
+   // ---- Flatten the tree, which is deterministic because entries are
+   //      sorted, and because a directory reached twice is only taken where
+   //      it comes first (and listed now, if the walk reached it elsewhere)
+   std::set<std::pair<uint64_t, uint64_t>> visited;
+   std::function<void(WalkNode&, PathTable::Id)> flatten
+       = [&](WalkNode& node, PathTable::Id dir) {
+            if(!node.listed) node.stamp = stat_stamp(node.path.c_str());
+            if(!visited.emplace(node.stamp.dev, node.stamp.ino).second) return;
+            if(!node.listed) list_directory(walker, node);
+            if(cache != nullptr) update_cache(node);
+            if(listed != nullptr) listed->push_back(node.path);
+            if(read != nullptr)
+               read->insert(
+                   end(*read), cbegin(node.ignore_files), cend(node.ignore_files));
+            for(const auto& entry : node.entries) {
+               if(entry.skipped) continue;
+               const auto id = intern_child(paths, dir, entry.name);
+               if(entry.dir)
+                  flatten(*entry.dir, id);
+               else
+                  files.push_back(id);
+            }
+         };
+
+   for(auto i = 0u; i < roots.size(); ++i) {
+      const auto root          = intern_path(paths, roots[i]);
+      paths.entries[root].root = root;
+      flatten(nodes[i], root);
+   }
+}
+
+// -------------------------------------------------------------------- git-index
+
+// Walk order: each directory's entries sorted by name, and depth first. That
+// is, full paths compared as if '/' came before any other character.
+static bool walk_order(string_view a, string_view b)
+{
+   const auto n = std::min(a.size(), b.size());
+   for(auto i = 0u; i < n; ++i) {
+      if(a[i] == b[i]) continue;
+      if(a[i] == '/') return true;
+      if(b[i] == '/') return false;
+      return uint8_t(a[i]) < uint8_t(b[i]);
+   }
+   return a.size() < b.size();
+}
+
+// Removes '.' and '..' (and repeated '/') from an absolute path
+static string normalize_path(string_view path)
+{
+   string out;
+   while(!path.empty()) {
+      const auto pos  = path.find('/');
+      const auto part = path.substr(0, pos);
+      path = (pos == string_view::npos) ? string_view{} : path.substr(pos + 1);
+      if(part.empty() || part == "."sv) continue;
+      if(part == ".."sv) {
+         out.resize(out.empty() ? 0 : out.rfind('/'));
+         continue;
+      }
+      out += '/';
+      out += part;
+   }
+   return out.empty() ? "/"s : out;
+}
+
+// The whole file, or "" if it can't be read
+static string read_binary_file(const string& filename)
+{
+   string data;
+   const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+   if(fd < 0) return data;
+   struct stat st;
+   if(fstat(fd, &st) == 0 && st.st_size > 0) {
+      data.resize(size_t(st.st_size));
+      size_t pos = 0;
+      while(pos < data.size()) {
+         const auto n = read(fd, &data[pos], data.size() - pos);
+         if(n < 0 && errno == EINTR) continue;
+         if(n <= 0) break;
+         pos += size_t(n);
+      }
+      data.resize(pos);
+   }
+   close(fd);
+   return data;
+}
+
+// Finds the work tree (and git directory) that encloses 'dir'
+static bool find_git_repository(string dir, string& work_tree, string& git_dir)
+{
+   for(;;) {
+      const auto dot_git = dir + (dir == "/" ? "" : "/") + ".git";
+      struct stat st;
+      if(stat(dot_git.c_str(), &st) == 0) {
+         work_tree = dir;
+         git_dir   = dot_git;
+         if(S_ISDIR(st.st_mode)) return true;
+
+         // A worktree or submodule: '.git' is a file, 'gitdir: <path>'
+         auto data = read_binary_file(dot_git);
+         if(!starts_with(data, "gitdir:")) return false;
+         data.erase(0, 7);
+         trim(data);
+         if(data.empty()) return false;
+         git_dir = normalize_path(data.front() == '/' ? data : dir + "/" + data);
+         return true;
+      }
+      if(dir == "/") return false;
+      dir = normalize_path(dir + "/..");
+   }
+}
+
+// The size of object ids: SHA-1, unless the repository uses SHA-256
+static size_t git_hash_size(const string& git_dir)
+{
+   auto common_dir = read_binary_file(git_dir + "/commondir");
+   trim(common_dir);
+   const auto config_dir
+       = common_dir.empty() ? git_dir
+         : (common_dir.front() == '/') ? common_dir
+                                       : git_dir + "/" + common_dir;
+   std::istringstream config(read_binary_file(config_dir + "/config"));
+   string line;
+   while(std::getline(config, line)) {
+      line.erase(std::remove_if(begin(line), end(line), ::isspace), end(line));
+      std::transform(begin(line), end(line), begin(line), ::tolower);
+      if(line == "objectformat=sha256") return 32;
+   }
+   return 20;
+}
+
+// Reads the paths (relative to the work tree) of the regular files in a git
+// index (versions 2, 3 and 4), in the index's order. Symlinks are kept if
+// they point to a regular file, as when walking. Submodules, and
+// sparse-checkout files that aren't on disk, are skipped. The paths are
+// views into 'names'.
+static vector<string_view> read_git_index(const string& filename,
+                                          size_t hash_size,
+                                          const string& work_tree,
+                                          string& names)
+{
+   const auto data = read_binary_file(filename);
+   vector<string_view> paths;
+   if(data.empty()) return paths; // i.e., no commits yet
+
+   auto corrupt = [&]() {
+      return std::runtime_error("corrupt git index: '" + filename + "'");
+   };
+
+   size_t pos   = 0;
+   auto need    = [&](size_t n) {
+      if(pos + n > data.size()) throw corrupt();
+   };
+   auto read_u16 = [&]() {
+      need(2);
+      const auto p = reinterpret_cast<const uint8_t*>(&data[pos]);
+      pos += 2;
+      return uint32_t(p[0]) << 8 | uint32_t(p[1]);
+   };
+   auto read_u32 = [&]() {
+      const auto hi = read_u16();
+      return hi << 16 | read_u16();
+   };
+
+   need(12);
+   if(data.compare(0, 4, "DIRC") != 0) throw corrupt();
+   pos                 = 4;
+   const auto version  = read_u32();
+   const auto n_entries = read_u32();
+   if(version < 2 || version > 4)
+      throw std::runtime_error("unsupported git index version "
+                               + std::to_string(version) + ": '" + filename
+                               + "'");
+
+   vector<std::pair<size_t, size_t>> offsets; // into 'names'
+   offsets.reserve(n_entries);
+   names.clear();
+   names.reserve(data.size());
+
+   string path; // v4 paths are prefix-compressed against the previous one
+   for(auto i = 0u; i < n_entries; ++i) {
+      const auto start = pos;
+      need(40 + hash_size);
+      pos += 24; // ctime, mtime, dev, ino
+      const auto mode = read_u32();
+      pos += 12 + hash_size; // uid, gid, size, object id
+      const auto flags          = read_u16();
+      const auto extended_flags = (flags & 0x4000) ? read_u16() : 0u;
+      if(version < 3 && (flags & 0x4000)) throw corrupt();
+
+      if(version == 4) {
+         // The number of bytes to strip from the previous path, as git's
+         // offset varint, then the (nul terminated) rest of the path
+         need(1);
+         size_t strip = uint8_t(data[pos]) & 0x7f;
+         while(uint8_t(data[pos++]) & 0x80) {
+            need(1);
+            strip = ((strip + 1) << 7) | (uint8_t(data[pos]) & 0x7f);
+         }
+         if(strip > path.size()) throw corrupt();
+         const auto end = data.find('\0', pos);
+         if(end == string::npos) throw corrupt();
+         path.resize(path.size() - strip);
+         path.append(data, pos, end - pos);
+         pos = end + 1;
+      } else {
+         const auto end = data.find('\0', pos);
+         if(end == string::npos) throw corrupt();
+         path.assign(data, pos, end - pos);
+         pos = start + ((end + 8 - start) & ~size_t(7)); // nul padded
+      }
+
+      const auto type         = mode >> 12;
+      const bool skip_worktree = (extended_flags & 0x4000) != 0;
+      if(skip_worktree || (type != 010 && type != 012)) continue;
+      if(!offsets.empty()
+         && string_view(names).substr(offsets.back().first,
+                                      offsets.back().second)
+                == path)
+         continue; // merge conflicts
+      if(type == 012) {
+         struct stat st;
+         const auto target = work_tree + "/" + path;
+         if(stat(target.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+      }
+      offsets.emplace_back(names.size(), path.size());
+      names += path;
+   }
+
+   paths.reserve(offsets.size());
+   for(const auto& [offset, size] : offsets)
+      paths.push_back(string_view(names).substr(offset, size));
+   return paths;
+}
+
+static void list_git_files(string_view base,
+                           const vector<string>& roots,
+                           const WalkFilter& filter,
+                           bool untracked,
+                           unsigned n_threads,
+                           ScanCache* cache,
+                           PathTable& paths,
+                           vector<PathTable::Id>& files,
+                           vector<string>* listed,
+                           vector<string>* read)
+{
+   const auto working_directory = normalize_path(base);
+
+   string work_tree, git_dir;
+   if(!find_git_repository(working_directory, work_tree, git_dir))
+      throw std::runtime_error("'from=git', but not in a git repository: '"
+                               + working_directory + "'");
+
+   const auto index_file = git_dir + "/index";
+   string names;
+   const auto tracked
+       = read_git_index(index_file, git_hash_size(git_dir), work_tree, names);
+   if(read != nullptr) read->push_back(index_file);
+
+   // The untracked files are those on disk that git doesn't ignore
+   WalkFilter untracked_filter = filter;
+   if(untracked) {
+      auto& ignore_files = untracked_filter.ignore_files;
+      if(std::find(cbegin(ignore_files), cend(ignore_files), ".gitignore")
+         == cend(ignore_files))
+         ignore_files.insert(begin(ignore_files), ".gitignore");
+      untracked_filter.excludes.push_back(make_glob("*/.git", false));
+   }
+
+   // A file below several roots is listed under the first only, as a walk
+   // lists it; by its absolute path
+   const bool overlapping = roots.size() > 1;
+   std::unordered_set<string> listed_files;
+   auto is_listed = [&](const string& absolute) {
+      return overlapping && !listed_files.insert(absolute).second;
+   };
+
+   for(const auto& root : roots) {
+      const auto full = normalize_path(
+          root.front() == '/' ? root : working_directory + "/" + root);
+      if(full != work_tree && !starts_with(full, work_tree + "/"))
+         throw std::runtime_error("'from=git', but '" + root
+                                  + "' is not in the git repository '"
+                                  + work_tree + "'");
+      const auto prefix = (full.size() > work_tree.size())
+                              ? full.substr(work_tree.size() + 1) + "/"
+                              : ""s;
+
+      const auto root_id       = intern_path(paths, root);
+      paths.entries[root_id].root = root_id;
+      const auto first_file    = files.size();
+
+      if(untracked)
+         walk_directories(base,
+                          {root},
+                          untracked_filter,
+                          n_threads,
+                          cache,
+                          paths,
+                          files,
+                          listed,
+                          read);
+      std::unordered_set<string_view> on_disk;
+      for(auto i = first_file; i < files.size(); ++i)
+         on_disk.insert(path_view(paths, files[i]));
+      if(overlapping)
+         files.erase(
+             std::remove_if(begin(files) + long(first_file),
+                            end(files),
+                            [&](auto id) {
+                               const auto path = string(path_view(paths, id));
+                               return is_listed(normalize_path(
+                                   path.front() == '/'
+                                       ? path
+                                       : working_directory + "/" + path));
+                            }),
+             end(files));
+
+      // The tracked files below 'root' (with the same prefix, so walk order
+      // is theirs relative to it)
+      vector<string_view> tracked_here;
+      for(auto ii = std::lower_bound(cbegin(tracked), cend(tracked), prefix);
+          ii != cend(tracked) && starts_with(*ii, prefix);
+          ++ii)
+         tracked_here.push_back(*ii);
+      if(!std::is_sorted(cbegin(tracked_here), cend(tracked_here), walk_order))
+         std::sort(begin(tracked_here), end(tracked_here), walk_order);
+
+      // Intern them (and their directories), skipping what's excluded
+      unordered_map<string_view, std::pair<PathTable::Id, bool>> dirs;
+      std::function<std::pair<PathTable::Id, bool>(string_view)> intern_dir
+          = [&](string_view dir) -> std::pair<PathTable::Id, bool> {
+         if(dir.empty()) return {root_id, false};
+         const auto ii = dirs.find(dir);
+         if(ii != dirs.end()) return ii->second;
+         const auto pos    = dir.rfind('/');
+         const auto parent = intern_dir(
+             pos == string_view::npos ? string_view{} : dir.substr(0, pos));
+         const auto id
+             = intern_child(paths, parent.first, dir.substr(pos + 1));
+         auto path     = string(path_view(paths, id));
+         bool excluded = parent.second || is_excluded(filter, path);
+         path += '/';
+         excluded = excluded || is_excluded(filter, path);
+         return dirs[dir] = {id, excluded};
+      };
+
+      string path;
+      for(const auto name : tracked_here) {
+         const auto relative = name.substr(prefix.size());
+         const auto pos      = relative.rfind('/');
+         const auto dir
+             = intern_dir(pos == string_view::npos ? string_view{}
+                                                   : relative.substr(0, pos));
+         if(dir.second) continue;
+         if(!on_disk.empty() || !filter.excludes.empty()) {
+            path = path_view(paths, dir.first);
+            if(path.back() != '/') path += '/';
+            path += relative.substr(pos + 1);
+            if(on_disk.count(path) > 0 || is_excluded(filter, path)) continue;
+         }
+         if(is_listed(work_tree + "/" + string(name))) continue;
+
+         files.push_back(
+             intern_child(paths, dir.first, relative.substr(pos + 1)));
+      }
+
+      if(untracked)
+         std::sort(begin(files) + first_file, end(files), [&](auto a, auto b) {
+            return walk_order(path_view(paths, a), path_view(paths, b));
+         });
+   }
+}
+
+// ------------------------------------------------------------------ shared-scan
+
+// The files that the first configuration found the same way, if any
+static const SharedScan::Walk* find_shared_walk(const State& state,
+                                                uint64_t key)
+{
+   if(state.shared == nullptr || state.shared->recording) return nullptr;
+   const auto ii = state.shared->walks.find(key);
+   return (ii == state.shared->walks.end()) ? nullptr : &ii->second;
+}
+
+static void record_walk(SharedScan& shared,
+                        uint64_t key,
+                        const vector<string>& roots,
+                        const PathTable& paths,
+                        const vector<PathTable::Id>& files,
+                        const vector<string>& listed,
+                        const vector<string>& read)
+{
+   unordered_map<string_view, uint32_t> root_index;
+   for(auto i = 0u; i < roots.size(); ++i) root_index.emplace(roots[i], i);
+
+   auto& walk = shared.walks[key];
+   walk       = SharedScan::Walk{};
+   walk.roots = roots;
+   walk.files.reserve(files.size());
+   walk.file_roots.reserve(files.size());
+   for(const auto id : files) {
+      const auto root = path_view(paths, paths.entries[id].root);
+      assert(root_index.count(root) > 0);
+      walk.files.emplace_back(path_view(paths, id));
+      walk.file_roots.push_back(root_index[root]);
+   }
+   walk.listed = listed;
+   walk.read   = read;
+}
+
+static void replay_walk(const SharedScan::Walk& walk,
+                        PathTable& paths,
+                        vector<PathTable::Id>& files)
+{
+   vector<PathTable::Id> roots;
+   for(const auto& root : walk.roots) {
+      roots.push_back(intern_path(paths, root));
+      paths.entries[roots.back()].root = roots.back();
+   }
+   files.reserve(files.size() + walk.files.size());
+   for(auto i = 0u; i < walk.files.size(); ++i)
+      files.push_back(intern_path(
+          paths, walk.files[i], PathTable::k_none, roots[walk.file_roots[i]]));
+}
+
+// The first configuration's output for a +src block, if it has one
+static const ScanCache::Block* find_shared_block(const State& state,
+                                                 uint64_t key)
+{
+   if(state.shared == nullptr || state.shared->recording) return nullptr;
+   const auto ii = state.shared->blocks.find(key);
+   return (ii == state.shared->blocks.end()) ? nullptr : &ii->second;
+}
+
+// The first configuration's scan of 'path', if it has one
+static const ScanCache::Module* find_shared_module(const State& state,
+                                                   const string& path)
+{
+   if(state.shared == nullptr || state.shared->recording) return nullptr;
+   const auto& modules = state.shared->cache.modules;
+   const auto ii       = modules.find(path);
+   return (ii != modules.end() && ii->second.used) ? &ii->second : nullptr;
+}
+
+// ------------------------------------------------------------------ unity-build
+
+// C and C++ sources, which a unity file can include; not headers, nor
+// module interfaces like '.mxx'
+static bool is_unity_source(string_view fname)
+{
+   const auto pos = fname.rfind('.');
+   if(pos == string_view::npos || fname.find('/', pos) != string_view::npos)
+      return false;
+   const auto ext = fname.substr(pos + 1);
+   return ext == "c" || ext == "cc" || ext == "cp" || ext == "cpp"
+          || ext == "cxx" || ext == "c++" || ext == "C" || ext == "CPP";
+}
+
+// Splits each rule's sources (or each rule's sources in each directory,
+// with 'unity_by=dir') into batches of 'unity.size', in walk order. Sources
+// that declare modules are left alone, as is a batch of one. Sets
+// 'batch_of' to the batch of each file, or -1.
+static vector<UnityBatch> make_unity_batches(State& state,
+                                             const UnityOptions& unity,
+                                             unsigned block,
+                                             const vector<FileCommand>& commands,
+                                             const vector<PathTable::Id>& files,
+                                             const vector<int>& matches,
+                                             vector<int>& batch_of)
+{
+   const auto& paths = state.paths;
+   vector<UnityBatch> batches;
+   unordered_map<string, std::pair<int, unsigned>> groups; // open batch, count
+   batch_of.assign(files.size(), -1);
+
+   for(auto i = 0u; i < files.size(); ++i) {
+      if(matches[i] < 0) continue;
+      const auto& cmd   = commands[matches[i]];
+      const auto fname = path_view(paths, files[i]);
+      if(!is_unity_source(fname)
+         || (cmd.scans_modules && !state.dyndep_prefix.empty())
+         || source_module(state, fname).is_module_unit)
+         continue;
+
+      // i.e., '0-1-src.lib-3-<hash>.cpp', for the 4th batch of rule 1 in
+      // 'src/lib', where the hash (of its sources) is set below
+      auto stem = std::to_string(block) + "-" + std::to_string(matches[i]);
+      if(unity.by_dir) {
+         const auto slash = fname.rfind('/');
+         auto dir = (slash == string_view::npos) ? ""sv : fname.substr(0, slash);
+         while(starts_with(dir, "./") || starts_with(dir, "/"))
+            dir.remove_prefix(dir.front() == '.' ? 2 : 1);
+         stem += '-';
+         for(auto c : dir) stem += (c == '/') ? '.' : c;
+      }
+
+      auto& [open, count] = groups.try_emplace(stem, -1, 0u).first->second;
+      if(open < 0 || batches[size_t(open)].sources.size() == unity.size) {
+         open = int(batches.size());
+         batches.emplace_back();
+         auto& batch    = batches.back();
+         batch.filename = unity.dir + (unity.dir.back() == '/' ? "" : "/")
+                          + stem + "-" + std::to_string(count++);
+         batch.command  = matches[i];
+      }
+      batches[size_t(open)].sources.push_back(files[i]);
+      batch_of[i] = open;
+   }
+
+   // A batch of one is just the source itself. The others are named for
+   // their sources too, so that two configurations (--config) whose blocks
+   // find different files never share a unity file.
+   vector<int> renumbered(batches.size(), -1);
+   vector<UnityBatch> kept;
+   for(auto i = 0u; i < batches.size(); ++i) {
+      if(batches[i].sources.size() < 2) continue;
+      Hasher hasher;
+      for(const auto id : batches[i].sources) hasher.add(path_view(paths, id));
+      char suffix[24];
+      snprintf(suffix, sizeof(suffix), "-%016llx.cpp",
+               static_cast<unsigned long long>(hasher.hash));
+      batches[i].filename += suffix;
+      renumbered[i] = int(kept.size());
+      kept.push_back(std::move(batches[i]));
+   }
+   for(auto& batch : batch_of)
+      if(batch >= 0) batch = renumbered[size_t(batch)];
+   return kept;
+}
+
+// How a unity file in 'dir' includes 'source': relative to it, where that
+// is possible, so that the unity files can move with the tree
+static string unity_include_path(const State& state,
+                                 string_view dir,
+                                 string_view source)
+{
+   if(!source.empty() && source.front() != '/' && dir.front() != '/') {
+      string up;
+      bool is_relative = true;
+      while(!dir.empty() && is_relative) {
+         const auto pos  = dir.find('/');
+         const auto part = dir.substr(0, pos);
+         dir = (pos == string_view::npos) ? string_view{} : dir.substr(pos + 1);
+         if(part == ".."sv) is_relative = false;
+         if(!part.empty() && part != "."sv) up += "../";
+      }
+      if(is_relative) return up + string(source);
+   }
+   return normalize_path(absolute_path(state, src_path(state, source)));
+}
+
+// Writes the batch's unity file, if it changed, returning its path
+static string write_unity_file(State& state,
+                               const UnityOptions& unity,
+                               const UnityBatch& batch)
+{
+   string text = "// Generated by mobius (unity=" + std::to_string(unity.size)
+                 + "); do not edit\n";
+   for(const auto id : batch.sources)
+      text += "#include \""
+              + unity_include_path(state, unity.dir, path_view(state.paths, id))
+              + "\"\n";
+
+   auto path = src_path(state, batch.filename);
+   WriteIfChanged file;
+   open_write_if_changed(file, path);
+   write_if_changed(file, text);
+   commit_write_if_changed(file);
+   return path;
+}
+
+// As 'mkdir -p'
+static void make_directories(const string& dname)
+{
+   for(auto pos = dname.find('/', 1); ; pos = dname.find('/', pos + 1)) {
+      const auto dir = dname.substr(0, pos);
+      if(mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+         throw std::runtime_error("failed to create directory '" + dir
+                                  + "': " + strerror(errno));
+      if(pos == string::npos) break;
+   }
+}
+
+// -------------------------------------------------------- join-filter-products
+
+// Sets each filter's variable to the (sorted) files that matched it
+static void join_filter_products(State& state, vector<FilterVariable>& filters)
+{
+   PhaseTimer timer(state.profile, Profile::FILTER);
+
+   // ---- Ensure that environment variables exist for all filters
+   for(auto& filter : filters) {
+      auto ii = state.env.find(filter.variable);
+      if(ii == cend(state.env)) state.env[filter.variable] = string{};
+   }
+
+   // ---- Now update any environment variables (via filter products)
+   const auto& paths        = state.paths;
+   auto is_main_source_file = [&](PathTable::Id id) {
+      const auto fname = path_view(paths, id);
+      return ends_with(fname, "main.cpp"sv) || ends_with(fname, "main.cc"sv)
+             || ends_with(fname, "main.cxx"sv) || ends_with(fname, "main.c"sv);
+   };
+   auto by_path = [&](PathTable::Id a, PathTable::Id b) {
+      return walk_order(path_view(paths, a), path_view(paths, b));
+   };
+
+   for(auto& filter : filters) {
+      if(!filter.products.empty()) {
+         auto ii = state.env.find(filter.variable);
+         bool first = true; // do we place a space...
+
+         // Size the value up front, so it is built with one allocation
+         size_t size = (ii == state.env.end()) ? 0 : ii->second.size();
+         for(const auto id : filter.products) size += paths.entries[id].size + 1;
+         string value;
+         value.reserve(size);
+
+         if(ii != state.env.end()) {
+            value += ii->second;
+            first = false;
+         }
+
+         // sort the filter (in walk order), such that any `main.cpp` files
+         // come first
+         auto& products  = filter.products;
+         const auto mains = std::partition(
+             begin(products), end(products), is_main_source_file);
+         std::sort(begin(products), mains, by_path);
+         std::sort(mains, end(products), by_path);
+
+         for(const auto id : products) {
+            if(first)
+               first = false;
+            else
+               value += ' ';
+            value += path_view(paths, id);
+         }
+
+         state.env[filter.variable] = std::move(value);
+         filter.products.clear();
+      }
+   }
+}
+
+// --------------------------------------------------------- process-src-command
+
+static void process_src_command(State& state, const vector<string> command)
+{
+   const auto block_start = state.profile ? profile_clock(*state.profile) : 0.0;
+   const auto block_start_cpu = state.profile ? process_cpu_clock() : 0.0;
+
+   // ---- Parse the source line...
+   string cd_dir = "";
+   vector<FilterVariable> filters;
+   vector<string> directories;
+   WalkFilter walk_filter;
+   string from = "fs";
+   UnityOptions unity;
+   {
+      vector<string> src_parts;
+      std::istringstream iss(command[0]);
+      std::copy(std::istream_iterator<string>(iss),
+                std::istream_iterator<string>(),
+                std::back_inserter(src_parts));
+      if(src_parts[0] != "+src")
+         throw std::runtime_error("failed to match '+src' in command");
+
+      for(auto i = 1u; i < src_parts.size(); ++i) {
+         auto& part = src_parts[i];
+         auto pos   = part.find('=');
+         if(pos == string::npos) {
+            directories.emplace_back(std::move(part));
+         } else {
+            string var   = part.substr(0, pos);
+            string value = part.substr(pos + 1);
+            if(var == "cd") {
+               if(cd_dir != "")
+                  throw std::runtime_error("multiple 'cd' specifiers");
+               cd_dir = std::move(value);
+            } else if(var == "exclude") {
+               walk_filter.excludes.push_back(
+                   make_glob(value, state.opts.regex_globs));
+            } else if(var == "ignore") {
+               walk_filter.ignore_files.emplace_back(std::move(value));
+            } else if(var == "from") {
+               if(value != "fs" && value != "git" && value != "git+untracked")
+                  throw std::runtime_error("unknown 'from' source: '" + value
+                                           + "'");
+               from = std::move(value);
+            } else if(var == "unity") {
+               const bool is_number
+                   = !value.empty()
+                     && std::all_of(cbegin(value), cend(value), [](char c) {
+                           return std::isdigit(uint8_t(c));
+                        });
+               unity.size = is_number ? unsigned(atoi(value.c_str())) : 0;
+               if(unity.size == 0)
+                  throw std::runtime_error("expected a number of sources: "
+                                           "'unity="
+                                           + value + "'");
+            } else if(var == "unity_by") {
+               if(value != "dir" && value != "rule")
+                  throw std::runtime_error("unknown 'unity_by': '" + value
+                                           + "'");
+               unity.by_dir = (value == "dir");
+            } else if(var == "unity_dir") {
+               if(value.empty())
+                  throw std::runtime_error("expected a directory: 'unity_dir='");
+               unity.dir = std::move(value);
+            } else {
+               filters.emplace_back();
+               auto& filter    = filters.back();
+               filter.variable = std::move(var);
+               filter.glob     = make_glob(value, state.opts.regex_globs);
+               filter.filter   = std::move(value);
+            }
+         }
+      }
+   }
+
+   if(!state.opts.unity_build) unity.size = 0; // --no-unity
+
+   // ---- Parse each of the command lines
+   vector<FileCommand> commands;
+   for(auto i = 1u; i < command.size(); ++i) {
+      if(starts_with(command[i], "~")) {
+         if(commands.size() == 0)
+            throw std::runtime_error("misplaced command extension '~'");
+         auto pos = command[i].find('~');
+         commands.back().command += "\n" + command[i].substr(pos + 1);
+         continue;
+      }
+
+      vector<string> parts;
+      std::istringstream iss(command[i]);
+      std::copy(std::istream_iterator<string>(iss),
+                std::istream_iterator<string>(),
+                std::back_inserter(parts));
+      assert(parts.size() > 0 && parts[0] == "-");
+      if(parts.size() < 2)
+         throw std::runtime_error("failed to match file rule '" + command[i]
+                                  + "'");
+
+      // implode tokens [2..]
+      std::stringstream ss("");
+      for(auto j = 2u; j < parts.size(); ++j) {
+         if(j > 2) ss << " ";
+         ss << parts[j];
+      }
+
+      commands.emplace_back();
+      auto& cmd   = commands.back();
+      cmd.pattern = parts[1];
+      cmd.glob    = make_glob(cmd.pattern, state.opts.regex_globs);
+      cmd.command = ss.str();
+
+      // Find the outputs (those parts[2..] before the first ':')
+      auto last_output_ind = 0u;
+      for(auto j = 2u; j < parts.size(); ++j) {
+         if(parts[j].back() == ':') {
+            last_output_ind = j + 1; // 1 past the end
+            break;
+         }
+      }
+
+      // Now add those outputs with shebangs to the 're-add' list
+      for(auto j = 2u; j < last_output_ind; ++j) {
+         if(parts[j].back() == ':') parts[j].pop_back();
+         if(parts[j].back() == '!') {
+            parts[j].pop_back();
+            cmd.re_add_outputs.push_back(parts[j]);
+         } else {
+            cmd.other_outputs.push_back(parts[j]);
+         }
+      }
+      if(parts.size() > 3 && parts[2] == "build" && last_output_ind > 3)
+         cmd.primary_output = parts[3];
+   }
+
+   for(auto& cmd : commands) {
+      cmd.command_template = compile_command_template(cmd.command);
+      for(const auto& s : cmd.re_add_outputs)
+         cmd.re_add_templates.push_back(compile_command_template(s));
+      for(const auto& s : cmd.other_outputs)
+         cmd.other_templates.push_back(compile_command_template(s));
+
+      auto has_question = [](const string& s) {
+         return s.find('?') != string::npos;
+      };
+      cmd.scans_modules
+          = has_question(cmd.command)
+            || std::any_of(cbegin(cmd.re_add_outputs),
+                           cend(cmd.re_add_outputs),
+                           has_question)
+            || std::any_of(
+                cbegin(cmd.other_outputs), cend(cmd.other_outputs), has_question);
+
+      if(cmd.scans_modules && !state.opts.dyndep_dir.empty()) {
+         if(cmd.primary_output.empty())
+            throw std::runtime_error("--dyndep needs a build statement for '?': '"
+                                     + cmd.command + "'");
+         const auto pos       = std::min(cmd.command.find('\n'), cmd.command.size());
+         cmd.head_template    = compile_command_template(cmd.command.substr(0, pos));
+         cmd.tail_template    = compile_command_template(cmd.command.substr(pos));
+         cmd.primary_template = compile_command_template(cmd.primary_output);
+      }
+   }
+
+   // ---- The walk can skip directories that no rule could match
+   walk_filter.prune_by_rules = true;
+   for(const auto& cmd : commands) {
+      if(cmd.glob.prefix.empty()) walk_filter.prune_by_rules = false;
+      walk_filter.rule_prefixes.push_back(cmd.glob.prefix);
+   }
+
+   // ---- The search directories are relative to 'cd', without changing
+   //      the working directory, which other configurations share
+   if(cd_dir != "") {
+      struct stat st;
+      if(stat(cd_dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+         throw std::runtime_error("failed to change directory to: '" + cd_dir
+                                  + "'");
+   }
+   state.cd_dir = cd_dir;
+
+   // ---- Search directories, unless another configuration already did
+   auto& paths = state.paths;
+   clear_path_table(paths);
+   vector<PathTable::Id> files;
+   ScanCache* cache = state.caching ? &state.cache : nullptr;
+   vector<string> listed, read;
+
+   uint64_t walk_key = 0;
+   if(state.shared != nullptr) {
+      Hasher hasher;
+      hasher.add(state.current_working_directory);
+      hasher.add(cd_dir);
+      hasher.add(from);
+      for(const auto& dir : directories) hasher.add(dir);
+      for(const auto& glob : walk_filter.excludes) hasher.add(glob.pattern);
+      for(const auto& name : walk_filter.ignore_files) hasher.add(name);
+      hasher.add(walk_filter.prune_by_rules ? "prune" : "all");
+      for(const auto& prefix : walk_filter.rule_prefixes) hasher.add(prefix);
+      hasher.add(state.opts.regex_globs ? "regex-globs" : "globs");
+      walk_key = hasher.hash;
+   }
+
+   const auto shared_walk = find_shared_walk(state, walk_key);
+   if(shared_walk != nullptr) {
+      replay_walk(*shared_walk, paths, files);
+      listed = shared_walk->listed;
+      read   = shared_walk->read;
+   } else {
+      PhaseTimer timer(state.profile, Profile::WALK);
+      const bool track = state.track_inputs || state.shared != nullptr;
+      if(from == "fs")
+         walk_directories(cd_dir,
+                          directories,
+                          walk_filter,
+                          state.opts.n_threads,
+                          cache,
+                          paths,
+                          files,
+                          track ? &listed : nullptr,
+                          track ? &read : nullptr);
+      else
+         list_git_files(absolute_path(state, cd_dir),
+                        directories,
+                        walk_filter,
+                        from == "git+untracked",
+                        state.opts.n_threads,
+                        cache,
+                        paths,
+                        files,
+                        track ? &listed : nullptr,
+                        track ? &read : nullptr);
+      if(state.shared != nullptr && state.shared->recording)
+         record_walk(
+             *state.shared, walk_key, directories, paths, files, listed, read);
+   }
+   const auto n_walked_files = files.size();
+
+   // The search directory that a file was found in
+   auto root_of = [&](PathTable::Id id) {
+      const auto root = paths.entries[id].root;
+      return (root == PathTable::k_none) ? ""sv : path_view(paths, root);
+   };
+
+   if(state.track_inputs) {
+      for(const auto& dname : listed)
+         state.listed_dirs.push_back(absolute_path(state, dname));
+      for(const auto& fname : read)
+         state.read_files.push_back(absolute_path(state, fname));
+   }
+
+   // ---- With --dyndep, '?' is resolved when building
+   const bool scans_modules
+       = std::any_of(cbegin(commands), cend(commands), [](const auto& cmd) {
+            return cmd.scans_modules;
+         });
+   state.dyndep_prefix.clear();
+   state.dyndep_scans.clear();
+   if(scans_modules && !state.opts.dyndep_dir.empty()) {
+      const auto& dir     = state.opts.dyndep_dir;
+      state.dyndep_prefix = dir + (dir.back() == '/' ? "" : "/")
+                            + std::to_string(state.n_src_blocks);
+      if(!state.dyndep_rules_written) write_dyndep_rules(state);
+   }
+
+   // ---- With --shard, the block's output goes to its own file
+   Shard* shard = nullptr;
+   if(state.opts.shard_output) {
+      state.shards.push_back(std::make_unique<Shard>());
+      shard = state.shards.back().get();
+      open_write_if_changed(shard->file,
+                            shard_filename(state.opts, state.n_src_blocks));
+      shard->out.profile = state.profile;
+      state.out << "subninja "
+                << ninja_escape(shard_filename(state.opts, state.n_src_blocks))
+                << '\n';
+   }
+   ++state.n_src_blocks;
+   OutputBuffer& dest = shard ? shard->out : state.out;
+
+   vector<uint64_t> n_matches(commands.size()); // for each command
+
+   auto finish_block = [&](bool from_cache) {
+      if(shard) { // committed later, so let go of its buffer now
+         flush_output(shard->out);
+         shard->out.buffer = string();
+      }
+
+      if(state.profile == nullptr) return;
+      auto& profile = *state.profile;
+      profile.blocks.emplace_back();
+      auto& record       = profile.blocks.back();
+      record.name        = command[0];
+      record.start       = block_start;
+      record.seconds     = profile_clock(profile) - block_start;
+      record.cpu_seconds = process_cpu_clock() - block_start_cpu;
+      record.n_files     = n_walked_files;
+      record.from_cache  = from_cache;
+      for(auto i = 0u; i < commands.size(); ++i)
+         record.rule_matches.emplace_back(commands[i].pattern, n_matches[i]);
+      profile.n_files_visited += n_walked_files;
+   };
+
+   // ---- Reuse this block's output from the cache, if nothing has changed
+   uint64_t block_key = 0;
+   if(cache != nullptr) {
+      Hasher hasher;
+      for(const auto& line : command) hasher.add(line);
+      hasher.add(state.current_working_directory);
+      hasher.add(cd_dir);
+      hasher.add(state.opts.module_dir);
+      hasher.add(state.dyndep_prefix);
+      hasher.add(state.opts.regex_globs ? "regex-globs" : "globs");
+      hasher.add(state.opts.unity_build ? "unity" : "no-unity");
+      for(const auto& filter : filters) {
+         const auto ii = state.env.find(filter.variable);
+         hasher.add(ii == state.env.end() ? "unset" : "set");
+         if(ii != state.env.end()) hasher.add(ii->second);
+      }
+      for(const auto id : files) {
+         hasher.add(path_view(paths, id));
+         hasher.add(root_of(id));
+      }
+      block_key = hasher.hash;
+
+      auto reuse_block = [&](const ScanCache::Block& block) {
+         dest << block.output;
+         if(state.track_inputs)
+            for(const auto& input : block.inputs)
+               state.read_files.push_back(absolute_path(state, input.first));
+         for(const auto& [variable, value] : block.variables)
+            state.env[variable] = value;
+         if(state.opts.check_modules)
+            for(auto i = 0u; i < block.n_scanned; ++i)
+               state.module_files.push_back(block.inputs[i].first);
+         finish_block(true);
+      };
+
+      // The first configuration already did this very block
+      const auto shared_block = find_shared_block(state, block_key);
+      if(shared_block != nullptr) {
+         reuse_block(*shared_block);
+         return;
+      }
+
+      auto ii = cache->blocks.find(block_key);
+      if(ii != cache->blocks.end()) {
+         auto& block         = ii->second;
+         const bool is_valid = std::all_of(
+             cbegin(block.inputs), cend(block.inputs), [](const auto& input) {
+                return stat_stamp(input.first.c_str()) == input.second;
+             });
+         if(is_valid) {
+            block.used = true;
+
+            // Keep the (still valid) module scans for the next run
+            for(const auto& [path, stamp] : block.inputs) {
+               auto jj = cache->modules.find(path);
+               if(jj != cache->modules.end() && jj->second.stamp == stamp)
+                  jj->second.used = true;
+            }
+            reuse_block(block);
+            return;
+         }
+      }
+   }
+
+   OutputBuffer block_out;
+   OutputBuffer& out = (cache == nullptr) ? dest : block_out;
+   state.scanned_files.clear();
+   state.scanned_set.clear();
+
+   // ---- Index the commands and filters, so each file is classified once
+   vector<const Glob*> globs;
+   for(const auto& cmd : commands) globs.push_back(&cmd.glob);
+   const auto command_index = make_glob_index(std::move(globs));
+
+   globs.clear();
+   for(const auto& filter : filters) globs.push_back(&filter.glob);
+   const auto filter_index = make_glob_index(std::move(globs));
+
+   // ---- Match the files against the commands
+   vector<int> matches;
+   auto match_files = [&]() {
+      PhaseTimer timer(state.profile, Profile::MATCH);
+      matches.resize(files.size());
+      for(auto i = 0u; i < files.size(); ++i) {
+         matches[i]
+             = glob_index_first_match(command_index, path_view(paths, files[i]));
+         if(matches[i] >= 0) ++n_matches[matches[i]];
+      }
+   };
+   match_files();
+
+   // ---- Scan the files for '?' in parallel, before substituting in order.
+   //      Unity builds leave out sources that declare modules, so scan
+   //      those too.
+   const bool scans_here = scans_modules && state.dyndep_prefix.empty();
+   if(scans_here || unity.size > 0) {
+      PhaseTimer timer(state.profile, Profile::SCAN);
+      vector<string> fnames;
+      for(auto i = 0u; i < files.size(); ++i) {
+         if(matches[i] < 0) continue;
+         const auto fname_view = path_view(paths, files[i]);
+         if(!(scans_here && commands[matches[i]].scans_modules)
+            && !(unity.size > 0 && is_unity_source(fname_view)))
+            continue;
+         auto fname = src_path(state, fname_view);
+         if(find_shared_module(state, fname) == nullptr)
+            fnames.push_back(std::move(fname));
+      }
+      prescan_module_dependences(state.cache, fnames, state.opts.n_threads);
+   }
+
+   // ---- With unity=, each rule's sources are compiled in batches
+   vector<UnityBatch> batches;
+   vector<int> batch_of; // for each of the walked files
+   vector<string> unity_files;
+   if(unity.size > 0) {
+      batches = make_unity_batches(state,
+                                   unity,
+                                   state.n_src_blocks - 1,
+                                   commands,
+                                   files,
+                                   matches,
+                                   batch_of);
+      PhaseTimer timer(state.profile, Profile::OUTPUT);
+      if(!batches.empty()) make_directories(src_path(state, unity.dir));
+      for(const auto& batch : batches)
+         unity_files.push_back(write_unity_file(state, unity, batch));
+   }
+
+   // A batch is substituted as its unity file, where its first source was
+   auto substitute_batch = [&](const UnityBatch& batch) {
+      for(const auto id : batch.sources)
+         state.unity_sources.push_back(path_view(paths, id));
+      command_substitute(state,
+                         out,
+                         batch.filename,
+                         unity.dir,
+                         commands[size_t(batch.command)],
+                         filters,
+                         filter_index);
+      state.unity_sources.clear();
+   };
+
+   // ---- Substitute the matched files into their commands
+   auto substitute = [&](size_t i) {
+      const auto id  = files[i];
+      const auto ind = matches[i];
+      if(ind < 0) return;
+
+      // Parse the command and add
+      const auto fname = path_view(paths, id);
+      const auto batch = (i < batch_of.size()) ? batch_of[i] : -1;
+      if(batch < 0)
+         command_substitute(
+             state, out, fname, root_of(id), commands[ind], filters, filter_index);
+      else if(batches[size_t(batch)].sources.front() == id)
+         substitute_batch(batches[size_t(batch)]);
+
+      // We may filter the input file as well...
+      glob_index_for_each_match(filter_index, fname, [&](auto ind) {
+         filters[ind].products.push_back(id);
+      });
+   };
+
+   while(files.size() > 0) {
+      {
+         PhaseTimer timer(state.profile, Profile::SUBSTITUTE);
+         for(auto i = 0u; i < files.size(); ++i) substitute(i);
+      }
+      batch_of.clear(); // only the walked files are batched
+      files.swap(state.additional_files);
+      state.additional_files.clear();
+      match_files();
+   }
+
+   if(!state.dyndep_scans.empty()) {
+      out << "build " << state.dyndep_prefix << ".dd: mobius_collate";
+      for(const auto& scan : state.dyndep_scans) out << ' ' << scan;
+      out << '\n';
+   }
+
+   join_filter_products(state, filters);
+
+   if(state.opts.check_modules)
+      state.module_files.insert(end(state.module_files),
+                                cbegin(state.scanned_files),
+                                cend(state.scanned_files));
+
+   if(state.track_inputs) {
+      for(const auto& path : state.scanned_files)
+         state.read_files.push_back(absolute_path(state, path));
+      for(const auto& path : unity_files)
+         state.read_files.push_back(absolute_path(state, path));
+   }
+
+   // ---- Save the block's output to the cache
+   if(cache != nullptr) {
+      ScanCache::Block block;
+      bool is_settled_block = true;
+      const auto now        = time(nullptr);
+      for(const auto& path : state.scanned_files) {
+         const auto shared = find_shared_module(state, path);
+         block.inputs.emplace_back(
+             path, shared ? shared->stamp : cache->modules[path].stamp);
+         is_settled_block = is_settled_block
+                            && is_settled(block.inputs.back().second, now);
+      }
+
+      // Rewritten if they're changed, or removed
+      block.n_scanned = block.inputs.size();
+      for(const auto& path : unity_files) {
+         block.inputs.emplace_back(path, stat_stamp(path.c_str()));
+         is_settled_block = is_settled_block
+                            && is_settled(block.inputs.back().second, now);
+      }
+      block.output = std::move(block_out.buffer);
+      for(const auto& filter : filters)
+         block.variables.emplace_back(filter.variable,
+                                      state.env[filter.variable]);
+      block.used = true;
+
+      dest << block.output;
+      if(state.shared != nullptr && state.shared->recording)
+         state.shared->blocks[block_key] = block;
+      if(is_settled_block) cache->blocks[block_key] = std::move(block);
+   }
+
+   if(state.profile != nullptr) {
+      state.profile->n_glob_evaluations
+          += command_index.n_evaluations + filter_index.n_evaluations;
+      state.profile->n_regex_evaluations += command_index.n_regex_evaluations
+                                            + filter_index.n_regex_evaluations;
+   }
+
+   finish_block(false);
+}
+
+// ----------------------------------------------------------------- process+src
+
+// Streams the input to the output a line at a time, expanding variables
+// once per line, and running each +src command as soon as it ends.
+static bool process_source_commands(State& state)
+{
+   vector<string> src_command;
+   for(string_view line; read_line(state.in, line);) {
+      // Skip comments
+      if(starts_with(line, "#")) {
+         state.out << line << '\n';
+         continue;
+      }
+
+      if(src_command.size() > 0      // we're in a command
+         && !starts_with(line, "~")  // not adding to previous command
+         && !starts_with(line, "-")) // not adding to a command
+      {
+         process_src_command(state, src_command);
+         src_command.clear();
+      }
+
+      auto is_command = [&](string_view line) {
+         return starts_with(line, "+src")
+                || (src_command.size() > 0
+                    && (starts_with(line, "-") || starts_with(line, "~")));
+      };
+
+      // Substitution of environment variables. Output lines are expanded
+      // straight into the output, unless a variable comes so early that
+      // it could make the line a command.
+      auto indent = 0u;
+      while(indent < line.size() && std::isspace(line[indent])) ++indent;
+      if(line.find('$') >= indent + 4 && !is_command(line)) {
+         expand_variables(state, line, state.out);
+         state.out << '\n';
+         continue;
+      }
+      line = substitute_env_variables(state, line);
+
+      // Process the line
+      if(starts_with(line, "+src")) {
+         assert(src_command.size() == 0);
+         src_command.emplace_back(line);
+
+      } else if(src_command.size() > 0
+                && (starts_with(line, "-") || starts_with(line, "~"))) {
+         src_command.emplace_back(line);
+
+      } else {
+         state.out << line << '\n';
+      }
+   }
+
+   if(src_command.size() > 0) {
+      process_src_command(state, src_command);
+      src_command.clear();
+   }
+
+   return true;
+}
+
+// ------------------------------------------------------------- transform input
+
+static bool transform_input(State& state)
+{
+   const auto& cache_file = state.cache_resident ? ""s : state.opts.cache_file;
+   if(!cache_file.empty()) load_scan_cache(state.cache, cache_file, state.err);
+   if(state.opts.shard_output) make_shard_directory(state.opts);
+   process_source_commands(state);
+   if(state.opts.check_modules) check_modules(state);
+   if(!state.opts.depfile.empty()) write_regenerate_edge(state);
+   if(state.profile != nullptr) {
+      state.profile->n_files_scanned = state.cache.n_files_scanned;
+      state.profile->n_bytes_scanned = state.cache.n_bytes_scanned;
+   }
+   if(!cache_file.empty()) save_scan_cache(state.cache, cache_file, state.err);
+   return true;
+}
+
+// -------------------------------------------------------------- configurations
+
+// 'filename', with '{config}' replaced by the configuration's name
+static string config_filename(const string& filename, const string& name)
+{
+   string result = filename;
+   for(auto pos = result.find("{config}"); pos != string::npos;
+       pos      = result.find("{config}", pos + name.size()))
+      result.replace(pos, 8, name);
+   return result;
+}
+
+// Adds the entries of 'from' that 'into' lacks, or has but did not use
+static void merge_scan_caches(ScanCache& into, ScanCache& from)
+{
+   for(auto& [key, dir] : from.dirs) into.dirs.emplace(key, std::move(dir));
+   for(auto& [key, block] : from.blocks)
+      into.blocks.emplace(key, std::move(block));
+   for(auto& [path, module] : from.modules) {
+      auto ii = into.modules.find(path);
+      if(ii == into.modules.end())
+         into.modules.emplace(path, std::move(module));
+      else if(!ii->second.used)
+         ii->second = std::move(module);
+   }
+}
+
+// The first configuration searches directories and scans files, as usual,
+// and records what it found. The others then reuse that, in parallel, and
+// only redo the +src blocks whose output their variables change.
+static bool run_configurations(Run& run)
+{
+   const auto& opts = run.opts;
+   const auto n     = opts.configs.size();
+
+   vector<Options> config_opts(n, opts);
+   for(auto i = 0u; i < n; ++i) {
+      const auto& [name, defines] = opts.configs[i];
+      auto& o                     = config_opts[i];
+      o.configs.clear();
+      for(const auto& [var, value] : defines) o.defines[var] = value;
+      for(auto filename : {&o.out_file,
+                           &o.depfile,
+                           &o.timings_file,
+                           &o.trace_file,
+                           &o.dyndep_dir,
+                           &o.module_dir,
+                           &o.diff_file})
+         *filename = config_filename(*filename, name);
+   }
+
+   SharedScan shared;
+   if(!opts.cache_file.empty())
+      load_scan_cache(shared.cache, opts.cache_file, run.err);
+   vector<ScanCache> caches(n);
+
+   // Each configuration's messages are printed together, once it's done
+   vector<string> messages(n);
+   vector<char> successes(n, false);
+   auto run_config = [&](size_t i) {
+      char* err_data  = nullptr;
+      size_t err_size = 0;
+      FILE* err       = open_memstream(&err_data, &err_size);
+      if(err == nullptr) return;
+      Run config_run(config_opts[i]);
+      config_run.err      = err;
+      config_run.resident = (i == 0) ? &shared.cache : &caches[i];
+      config_run.shared   = &shared;
+      config_run.input    = run.input;
+      config_run.environment = run.environment;
+      successes[i]           = run_mobius(config_run);
+      fclose(err);
+      messages[i].assign(err_data, err_size);
+      free(err_data);
+   };
+
+   run_config(0);
+   shared.recording = false;
+   vector<std::thread> threads;
+   for(auto i = 1u; i < n; ++i) threads.emplace_back(run_config, i);
+   for(auto& thread : threads) thread.join();
+
+   bool success = true;
+   for(auto i = 0u; i < n; ++i) {
+      if(!messages[i].empty())
+         fprintf(run.err,
+                 "configuration '%s':\n%s",
+                 opts.configs[i].first.c_str(),
+                 messages[i].c_str());
+      success = success && successes[i];
+   }
+
+   if(!opts.cache_file.empty() && success) {
+      for(auto i = 1u; i < n; ++i) merge_scan_caches(shared.cache, caches[i]);
+      save_scan_cache(shared.cache, opts.cache_file, run.err);
+   }
+   return success;
+}
+
+// --------------------------------------------------------------- manifest-diff
+
+static bool is_ninja_name_char(char c, bool braced)
+{
+   return std::isalnum(uint8_t(c)) || c == '_' || c == '-'
+          || (braced && c == '.');
+}
+
+// 'text' with ninja's '$' escapes and variables expanded, through 'lookup'
+static string expand_ninja(string_view text,
+                           const std::function<string(string_view)>& lookup)
+{
+   string out;
+   for(auto i = 0u; i < text.size(); ++i) {
+      if(text[i] != '$' || i + 1 == text.size()) {
+         out += text[i];
+         continue;
+      }
+      const char c = text[++i];
+      if(c == '{') {
+         const auto end = text.find('}', i);
+         if(end == string_view::npos) break;
+         out += lookup(text.substr(i + 1, end - i - 1));
+         i = unsigned(end);
+      } else if(is_ninja_name_char(c, false)) {
+         auto end = i;
+         while(end < text.size() && is_ninja_name_char(text[end], false)) ++end;
+         out += lookup(text.substr(i, end - i));
+         i = end - 1;
+      } else {
+         out += c; // '$$', '$ ', '$:'
+      }
+   }
+   return out;
+}
+
+// The manifest's lines, with '$' line continuations joined
+static vector<string> ninja_lines(string_view text)
+{
+   vector<string> lines(1);
+   for(auto i = 0u; i < text.size(); ++i) {
+      auto& line = lines.back();
+      if(text[i] != '\n') {
+         line += text[i];
+         continue;
+      }
+      auto n_dollars = 0u;
+      while(n_dollars < line.size() && line[line.size() - 1 - n_dollars] == '$')
+         ++n_dollars;
+      if(n_dollars % 2 == 0) {
+         lines.emplace_back();
+         continue;
+      }
+      line.pop_back(); // '$'
+      while(i + 1 < text.size() && text[i + 1] == ' ') ++i;
+   }
+   return lines;
+}
+
+// The parts of a build statement, as ninja's lexer splits them: paths (with
+// their escapes), and ':', '|', '||' and '|@'
+static vector<string> split_build_line(string_view line)
+{
+   vector<string> parts;
+   string path;
+   auto flush = [&]() {
+      if(!path.empty()) parts.push_back(std::move(path));
+      path.clear();
+   };
+   for(auto i = 0u; i < line.size(); ++i) {
+      const char c = line[i];
+      if(c == '$' && i + 1 < line.size()) {
+         const auto end = (line[i + 1] == '{') ? line.find('}', i) : i + 1;
+         path += line.substr(i, std::min(end, line.size() - 1) - i + 1);
+         i = unsigned(std::min(end, line.size() - 1));
+      } else if(c == ' ') {
+         flush();
+      } else if(c == ':') {
+         flush();
+         parts.emplace_back(":");
+      } else if(c == '|') {
+         flush();
+         const bool is_pair = i + 1 < line.size()
+                              && (line[i + 1] == '|' || line[i + 1] == '@');
+         parts.emplace_back(line.substr(i, is_pair ? 2 : 1));
+         if(is_pair) ++i;
+      } else {
+         path += c;
+      }
+   }
+   flush();
+   return parts;
+}
+
+// Reads 'name = value' from an indented line
+static bool parse_ninja_binding(string_view line, string& name, string& value)
+{
+   const auto pos = line.find('=');
+   if(pos == string_view::npos) return false;
+   auto trim = [](string_view s) {
+      while(!s.empty() && s.front() == ' ') s.remove_prefix(1);
+      while(!s.empty() && s.back() == ' ') s.remove_suffix(1);
+      return s;
+   };
+   name = string(trim(line.substr(0, pos)));
+   value = string(line.substr(pos + 1));
+   while(!value.empty() && value.front() == ' ') value.erase(0, 1);
+   return !name.empty();
+}
+
+// Included files are relative to the working directory, as they are for
+// ninja (which runs where mobius does)
+static void parse_ninja_manifest(string_view text,
+                                 unordered_map<string, string>& scope,
+                                 NinjaManifest& manifest,
+                                 unsigned depth)
+{
+   if(depth > 16) throw std::runtime_error("ninja includes nest too deeply");
+   auto from_scope = [&](string_view name) {
+      const auto ii = scope.find(string(name));
+      return (ii == scope.end()) ? ""s : ii->second;
+   };
+
+   const auto lines = ninja_lines(text);
+   for(auto i = 0u; i < lines.size(); ++i) {
+      const string_view line = lines[i];
+      auto is_indented = [&](size_t ind) {
+         return ind < lines.size() && !lines[ind].empty()
+                && (lines[ind][0] == ' ' || lines[ind][0] == '\t');
+      };
+      if(line.empty() || line[0] == '#' || is_indented(i)) continue;
+
+      // The statement's own bindings, on the indented lines that follow
+      vector<std::pair<string, string>> bindings;
+      for(string name, value; is_indented(i + 1); ++i) {
+         auto binding = string_view(lines[i + 1]);
+         while(!binding.empty() && (binding[0] == ' ' || binding[0] == '\t'))
+            binding.remove_prefix(1);
+         if(!binding.empty() && binding[0] != '#'
+            && parse_ninja_binding(binding, name, value))
+            bindings.emplace_back(name, value);
+      }
+
+      string name, value;
+      if(starts_with(line, "rule ")) {
+         std::sort(begin(bindings), end(bindings));
+         auto rule = line.substr(5);
+         while(!rule.empty() && rule.back() == ' ') rule.remove_suffix(1);
+         manifest.rules[string(rule)] = std::move(bindings);
+      } else if(starts_with(line, "build ")) {
+         NinjaEdge edge;
+         for(auto& [name, value] : bindings)
+            value = expand_ninja(value, from_scope);
+         std::sort(begin(bindings), end(bindings));
+         auto lookup = [&](string_view var) {
+            for(const auto& [name, value] : bindings)
+               if(name == var) return value;
+            return from_scope(var);
+         };
+
+         // Outputs, ':', the rule, and then the inputs
+         vector<string>* dest = &edge.outputs;
+         bool expect_rule     = false;
+         for(auto& part : split_build_line(line.substr(6))) {
+            if(part == ":") {
+               expect_rule = true;
+            } else if(expect_rule) {
+               edge.rule   = std::move(part);
+               dest        = &edge.inputs;
+               expect_rule = false;
+            } else if(part == "|") {
+               dest = (dest == &edge.outputs) ? &edge.implicit_outputs
+                                              : &edge.implicit_inputs;
+            } else if(part == "||") {
+               dest = &edge.order_only;
+            } else if(part == "|@") {
+               dest = &edge.validations;
+            } else {
+               dest->push_back(expand_ninja(part, lookup));
+            }
+         }
+         if(edge.outputs.empty()) continue;
+
+         // The command, as the rule runs it for this edge
+         const auto ii = manifest.rules.find(edge.rule);
+         if(ii != manifest.rules.end()) {
+            const auto& rule = ii->second;
+            auto join        = [](const vector<string>& paths, char sep) {
+               string joined;
+               for(const auto& path : paths)
+                  joined.append(joined.empty() ? "" : string(1, sep)) += path;
+               return joined;
+            };
+            unsigned recursion = 0;
+            std::function<string(string_view)> evaluate;
+            evaluate = [&](string_view var) -> string {
+               if(var == "in") return join(edge.inputs, ' ');
+               if(var == "in_newline") return join(edge.inputs, '\n');
+               if(var == "out") return join(edge.outputs, ' ');
+               for(const auto& [name, value] : bindings)
+                  if(name == var) return value;
+               for(const auto& [name, value] : rule)
+                  if(name == var && recursion < 64) {
+                     ++recursion;
+                     auto expanded = expand_ninja(value, evaluate);
+                     --recursion;
+                     return expanded;
+                  }
+               return from_scope(var);
+            };
+            edge.command = evaluate("command");
+         }
+         edge.bindings = std::move(bindings);
+         auto key      = edge.outputs.front();
+         manifest.edges[key] = std::move(edge);
+      } else if(starts_with(line, "include ") || starts_with(line, "subninja ")) {
+         const bool is_include = (line[0] == 'i');
+         auto filename
+             = expand_ninja(line.substr(is_include ? 8 : 9), from_scope);
+         const auto data = read_binary_file(filename);
+         if(data.empty() && access(filename.c_str(), F_OK) != 0)
+            throw std::runtime_error("failed to read ninja file '" + filename
+                                     + "'");
+         if(is_include) {
+            parse_ninja_manifest(data, scope, manifest, depth + 1);
+         } else {
+            auto child_scope = scope;
+            parse_ninja_manifest(data, child_scope, manifest, depth + 1);
+         }
+      } else if(!starts_with(line, "pool ") && !starts_with(line, "default ")
+                && parse_ninja_binding(line, name, value)) {
+         scope[name] = expand_ninja(value, from_scope);
+      }
+   }
+}
+
+// A manifest that doesn't exist (yet) is empty
+static void read_ninja_manifest(const string& filename, NinjaManifest& manifest)
+{
+   if(access(filename.c_str(), F_OK) != 0) return;
+   unordered_map<string, string> scope;
+   parse_ninja_manifest(read_binary_file(filename), scope, manifest, 0);
+}
+
+static void print_manifest_diff(FILE* fp,
+                                const string& old_name,
+                                const NinjaManifest& old_manifest,
+                                const NinjaManifest& new_manifest)
+{
+   // (what, name, how), sorted, so the report is the same every time
+   vector<std::tuple<string, string, string>> changes;
+   auto compare = [&](const char* what, const auto& olds, const auto& news,
+                      auto differences) {
+      for(const auto& [name, now] : news) {
+         const auto ii = olds.find(name);
+         if(ii == olds.end()) {
+            changes.emplace_back("added", string(what) + " " + name, "");
+         } else {
+            const auto how = differences(ii->second, now);
+            if(!how.empty())
+               changes.emplace_back("changed", string(what) + " " + name, how);
+         }
+      }
+      for(const auto& [name, old] : olds)
+         if(news.count(name) == 0)
+            changes.emplace_back("removed", string(what) + " " + name, "");
+   };
+
+   compare("rule",
+           old_manifest.rules,
+           new_manifest.rules,
+           [](const auto& old, const auto& now) {
+              std::set<string> names;
+              for(const auto& binding : old)
+                 if(std::find(cbegin(now), cend(now), binding) == cend(now))
+                    names.insert(binding.first);
+              for(const auto& binding : now)
+                 if(std::find(cbegin(old), cend(old), binding) == cend(old))
+                    names.insert(binding.first);
+              string how;
+              for(const auto& name : names) how += (how.empty() ? "" : ", ") + name;
+              return how;
+           });
+
+   compare("build",
+           old_manifest.edges,
+           new_manifest.edges,
+           [](const NinjaEdge& old, const NinjaEdge& now) {
+              string how;
+              auto differ = [&](bool is_different, const char* what) {
+                 if(is_different) how += (how.empty() ? "" : ", ") + string(what);
+              };
+              differ(old.rule != now.rule, "rule");
+              differ(old.command != now.command, "command");
+              differ(old.outputs != now.outputs, "outputs");
+              differ(old.implicit_outputs != now.implicit_outputs,
+                     "implicit outputs");
+              differ(old.inputs != now.inputs, "inputs");
+              differ(old.implicit_inputs != now.implicit_inputs,
+                     "implicit inputs");
+              differ(old.order_only != now.order_only, "order-only inputs");
+              differ(old.validations != now.validations, "validations");
+              differ(old.bindings != now.bindings, "variables");
+              return how;
+           });
+
+   std::sort(begin(changes), end(changes), [](const auto& a, const auto& b) {
+      return std::get<1>(a) < std::get<1>(b);
+   });
+   size_t n_added = 0, n_removed = 0;
+   for(const auto& change : changes) {
+      if(std::get<0>(change) == "added") ++n_added;
+      if(std::get<0>(change) == "removed") ++n_removed;
+   }
+   fprintf(fp,
+           "--diff '%s': %zu added, %zu removed, %zu changed\n",
+           old_name.c_str(),
+           n_added,
+           n_removed,
+           changes.size() - n_added - n_removed);
+   for(const auto& [what, name, how] : changes)
+      fprintf(fp,
+              "   %-8s %s%s%s\n",
+              what.c_str(),
+              name.c_str(),
+              how.empty() ? "" : ": ",
+              how.c_str());
+}
+
+// ---------------------------------------------------------------------- dyndep
+
+// Writes 'contents' to the sink, if there is one, else to 'filename', if it
+// changed, or to stdout
+static void write_result(const string& filename,
+                         string_view contents,
+                         const Sink& sink)
+{
+   if(sink) {
+      sink(contents);
+      return;
+   }
+   if(filename.empty() || filename == "-") {
+      write_all(STDOUT_FILENO, contents.data(), contents.size());
+      return;
+   }
+   WriteIfChanged file;
+   open_write_if_changed(file, filename);
+   write_if_changed(file, contents);
+   commit_write_if_changed(file);
+}
+
+// Declares the rules of the edges that --dyndep adds. Scans and dyndep
+// files are only rewritten if they change, so 'restat' stops the rebuilds
+// there.
+static void write_dyndep_rules(State& state)
+{
+   const auto exe         = ninja_escape_value(shell_quote(mobius_command(state)));
+   const auto& module_dir = state.opts.module_dir;
+   state.out << "rule mobius_scan\n   command = " << exe
+             << " --scan-deps $in --primary-output $primary_output -o $out\n"
+             << "   description = Scanning $in for modules\n"
+             << "   restat = 1\n"
+             << "rule mobius_collate\n   command = " << exe
+             << " --collate @$out.rsp";
+   if(!module_dir.empty()) state.out << " -m " << shell_quote(module_dir);
+   state.out << " -o $out\n"
+             << "   description = Collating module dependences for $out\n"
+             << "   rspfile = $out.rsp\n"
+             << "   rspfile_content = $in\n"
+             << "   restat = 1\n";
+   state.dyndep_rules_written = true;
+}
+
+// Writes the modules that a source file provides and requires, as P1689
+bool scan_deps(const Options& opts, FILE* err, const Sink& sink)
+{
+   const auto& fname = opts.scan_deps_file;
+   if(access(fname.c_str(), R_OK) != 0) {
+      fprintf(err, "failed to open source file '%s'\n", fname.c_str());
+      return false;
+   }
+
+   ScanCache::Module module;
+   scan_module_dependences(fname, module);
+
+   string json = "{\n  \"version\": 1,\n  \"revision\": 0,\n  \"rules\": [\n"
+                 "    {\n";
+   if(!opts.primary_output.empty())
+      json += "      \"primary-output\": \"" + json_escape(opts.primary_output)
+              + "\",\n";
+
+   json += "      \"provides\": [";
+   for(auto i = 0u; i < module.provided.size(); ++i)
+      json += (i > 0 ? ",\n" : "\n") + "        {\"logical-name\": \""s
+              + json_escape(module.provided[i]) + "\", \"source-path\": \""
+              + json_escape(fname) + "\"}";
+   json += module.provided.empty() ? "],\n" : "\n      ],\n";
+
+   // Header units are 'import <vector>;' or 'import "x.h";'
+   json += "      \"requires\": [";
+   auto n_required = 0u;
+   for(const auto& name : module.required)
+      json += (n_required++ > 0 ? ",\n" : "\n")
+              + "        {\"logical-name\": \""s + json_escape(name) + "\"}";
+   for(const auto& name : module.header_units) {
+      if(name.size() < 2) continue;
+      const auto method = (name[0] == '<') ? "include-angle" : "include-quote";
+      json += (n_required++ > 0 ? ",\n" : "\n")
+              + "        {\"logical-name\": \""s
+              + json_escape(name.substr(1, name.size() - 2))
+              + "\", \"lookup-method\": \"" + method + "\"}";
+   }
+   json += (n_required == 0) ? "]\n" : "\n      ]\n";
+   json += "    }\n  ]\n}\n";
+
+   try {
+      write_result(opts.out_file, json, sink);
+   } catch(std::exception& e) {
+      fprintf(err, "%s\n", e.what());
+      return false;
+   }
+   return true;
+}
+
+static const JsonValue* json_member(const JsonValue& value, string_view key)
+{
+   for(const auto& [name, member] : value.object)
+      if(name == key) return &member;
+   return nullptr;
+}
+
+// An empty array if 'key' is missing, or not an array
+static const vector<JsonValue>& json_array_member(const JsonValue& value,
+                                                 string_view key)
+{
+   static const vector<JsonValue> empty;
+   const auto member = json_member(value, key);
+   return (member != nullptr && member->type == JsonValue::ARRAY)
+              ? member->array
+              : empty;
+}
+
+static const string* json_string_member(const JsonValue& value,
+                                        string_view key)
+{
+   const auto member = json_member(value, key);
+   return (member != nullptr && member->type == JsonValue::STRING)
+              ? &member->str
+              : nullptr;
+}
+
+// Reads P1689 files, and writes a ninja dyndep file in which each rule's
+// primary output depends on the modules (.pcm files) that it requires
+bool collate(const Options& opts, FILE* err, const Sink& sink)
+{
+   try {
+      // The P1689 files, some of which may be listed in '@' response files
+      vector<string> fnames;
+      for(const auto& arg : opts.collate_files) {
+         if(arg.front() != '@') {
+            fnames.push_back(arg);
+            continue;
+         }
+         std::ifstream fin(arg.substr(1));
+         if(!fin)
+            throw std::runtime_error("failed to open response file '"
+                                     + arg.substr(1) + "'");
+         std::copy(std::istream_iterator<string>(fin),
+                   std::istream_iterator<string>(),
+                   std::back_inserter(fnames));
+      }
+
+      vector<JsonValue> rules;
+      for(const auto& fname : fnames) {
+         std::ifstream fin(fname, std::ios::binary);
+         if(!fin)
+            throw std::runtime_error("failed to open '" + fname + "'");
+         const string data((std::istreambuf_iterator<char>(fin)),
+                           std::istreambuf_iterator<char>());
+         const auto json = parse_json(data);
+         const auto& file_rules = json_array_member(json, "rules");
+         rules.insert(end(rules), cbegin(file_rules), cend(file_rules));
+      }
+
+      // Modules are prebuilt as '<module-dir>/name.pcm', and partitions as
+      // 'module-partition.pcm', unless a scanner says otherwise
+      const string_view modules_dir = opts.module_dir;
+      auto pcm_path                 = [&](const string& module) {
+         string path(modules_dir);
+         if(!path.empty() && path.back() != '/') path += '/';
+         for(auto c : module) path += (c == ':' ? '-' : c);
+         return path + ".pcm";
+      };
+
+      unordered_map<string, string> provided; // logical-name => .pcm
+      for(const auto& rule : rules) {
+         for(const auto& entry : json_array_member(rule, "provides")) {
+            const auto name = json_string_member(entry, "logical-name");
+            const auto path = json_string_member(entry, "compiled-module-path");
+            if(name != nullptr && path != nullptr) provided[*name] = *path;
+         }
+      }
+
+      string dyndep = "ninja_dyndep_version = 1\n";
+      for(const auto& rule : rules) {
+         const auto primary = json_string_member(rule, "primary-output");
+         if(primary == nullptr) continue;
+         dyndep += "build " + ninja_escape(*primary) + ": dyndep";
+
+         auto n_required = 0u;
+         for(const auto& entry : json_array_member(rule, "requires")) {
+            // Header units are not prebuilt, as with '?'
+            const auto name   = json_string_member(entry, "logical-name");
+            const auto method = json_string_member(entry, "lookup-method");
+            if(name == nullptr
+               || (method != nullptr && *method != "by-name"))
+               continue;
+            const auto path = json_string_member(entry, "compiled-module-path");
+            const auto ii   = provided.find(*name);
+            dyndep += (n_required++ == 0) ? " | " : " ";
+            dyndep += ninja_escape(path != nullptr         ? *path
+                                   : ii != provided.end() ? ii->second
+                                                          : pcm_path(*name));
+         }
+         dyndep += '\n';
+      }
+
+      write_result(opts.out_file, dyndep, sink);
+   } catch(std::exception& e) {
+      fprintf(err, "%s\n", e.what());
+      return false;
+   }
+   return true;
+}
+
+// ------------------------------------------------------------------ parse-json
+
+[[noreturn]] static void json_error(const string& what)
+{
+   throw std::runtime_error("invalid JSON: " + what);
+}
+
+static void skip_json_space(string_view& s)
+{
+   while(!s.empty() && std::isspace(static_cast<unsigned char>(s.front())))
+      s.remove_prefix(1);
+}
+
+static void append_utf8(string& out, uint32_t code)
+{
+   if(code < 0x80) {
+      out += char(code);
+   } else if(code < 0x800) {
+      out += char(0xc0 | (code >> 6));
+      out += char(0x80 | (code & 0x3f));
+   } else if(code < 0x10000) {
+      out += char(0xe0 | (code >> 12));
+      out += char(0x80 | ((code >> 6) & 0x3f));
+      out += char(0x80 | (code & 0x3f));
+   } else {
+      out += char(0xf0 | (code >> 18));
+      out += char(0x80 | ((code >> 12) & 0x3f));
+      out += char(0x80 | ((code >> 6) & 0x3f));
+      out += char(0x80 | (code & 0x3f));
+   }
+}
+
+// 's' starts at the opening quote
+static string parse_json_string(string_view& s)
+{
+   auto hex4 = [&]() {
+      if(s.size() < 4) json_error("bad '\\u' escape");
+      uint32_t code = 0;
+      for(auto i = 0; i < 4; ++i) {
+         const char c = s[size_t(i)];
+         code <<= 4;
+         if(c >= '0' && c <= '9')
+            code |= uint32_t(c - '0');
+         else if(c >= 'a' && c <= 'f')
+            code |= uint32_t(c - 'a' + 10);
+         else if(c >= 'A' && c <= 'F')
+            code |= uint32_t(c - 'A' + 10);
+         else
+            json_error("bad '\\u' escape");
+      }
+      s.remove_prefix(4);
+      return code;
+   };
+
+   string out;
+   s.remove_prefix(1);
+   for(;;) {
+      if(s.empty()) json_error("unterminated string");
+      const char c = s.front();
+      s.remove_prefix(1);
+      if(c == '"') return out;
+      if(c != '\\') {
+         out += c;
+         continue;
+      }
+
+      if(s.empty()) json_error("unterminated string");
+      const char e = s.front();
+      s.remove_prefix(1);
+      switch(e) {
+      case '"':
+      case '\\':
+      case '/': out += e; break;
+      case 'b': out += '\b'; break;
+      case 'f': out += '\f'; break;
+      case 'n': out += '\n'; break;
+      case 'r': out += '\r'; break;
+      case 't': out += '\t'; break;
+      case 'u': {
+         auto code = hex4();
+         if(code >= 0xd800 && code < 0xdc00 && s.size() >= 2 && s[0] == '\\'
+            && s[1] == 'u') { // a surrogate pair
+            s.remove_prefix(2);
+            const auto low = hex4();
+            code           = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+         }
+         append_utf8(out, code);
+      } break;
+      default: json_error("bad escape '\\"s + e + "'");
+      }
+   }
+}
+
+static JsonValue parse_json_value(string_view& s, int depth)
+{
+   if(depth > 256) json_error("nested too deeply");
+   skip_json_space(s);
+   if(s.empty()) json_error("unexpected end");
+
+   // Expects 'c' (after any space), and consumes it
+   auto expect = [&](char c) {
+      skip_json_space(s);
+      if(s.empty() || s.front() != c) json_error("expected '"s + c + "'");
+      s.remove_prefix(1);
+   };
+   auto at = [&](char c) {
+      skip_json_space(s);
+      return !s.empty() && s.front() == c;
+   };
+
+   JsonValue value;
+   const char c = s.front();
+   if(c == '{') {
+      value.type = JsonValue::OBJECT;
+      s.remove_prefix(1);
+      if(at('}')) {
+         s.remove_prefix(1);
+         return value;
+      }
+      do {
+         if(!at('"')) json_error("expected a key");
+         auto key = parse_json_string(s);
+         expect(':');
+         value.object.emplace_back(std::move(key),
+                                   parse_json_value(s, depth + 1));
+      } while(at(',') && (s.remove_prefix(1), true));
+      expect('}');
+   } else if(c == '[') {
+      value.type = JsonValue::ARRAY;
+      s.remove_prefix(1);
+      if(at(']')) {
+         s.remove_prefix(1);
+         return value;
+      }
+      do {
+         value.array.push_back(parse_json_value(s, depth + 1));
+      } while(at(',') && (s.remove_prefix(1), true));
+      expect(']');
+   } else if(c == '"') {
+      value.type = JsonValue::STRING;
+      value.str  = parse_json_string(s);
+   } else if(c == '-' || std::isdigit(static_cast<unsigned char>(c))) {
+      size_t len = 0;
+      while(len < s.size() && strchr("+-.0123456789eE", s[len]) != nullptr
+            && s[len] != '\0')
+         ++len;
+      const string number(s.substr(0, len));
+      char* end    = nullptr;
+      value.type   = JsonValue::NUMBER;
+      value.number = strtod(number.c_str(), &end);
+      if(end != number.c_str() + len) json_error("bad number '" + number + "'");
+      s.remove_prefix(len);
+   } else {
+      auto literal = [&](string_view word) {
+         if(s.substr(0, word.size()) != word) return false;
+         s.remove_prefix(word.size());
+         return true;
+      };
+      if(literal("true")) {
+         value.type    = JsonValue::BOOLEAN;
+         value.boolean = true;
+      } else if(literal("false")) {
+         value.type = JsonValue::BOOLEAN;
+      } else if(!literal("null")) {
+         json_error("unexpected '"s + c + "'");
+      }
+   }
+   return value;
+}
+
+static JsonValue parse_json(string_view text)
+{
+   auto value = parse_json_value(text, 0);
+   skip_json_space(text);
+   if(!text.empty()) json_error("unexpected text after the value");
+   return value;
+}
+
+// -------------------------------------------------------------- resident-cache
+
+ResidentCacheLoan::ResidentCacheLoan(ScanCache* resident_, ScanCache& cache_)
+    : resident(resident_)
+    , cache(cache_)
+{
+   if(resident == nullptr) return;
+   swap_scan_caches(*resident, cache);
+
+   // Everything is revalidated (by stamp) by each run
+   for(auto& [key, dir] : cache.dirs) dir.used = false;
+   for(auto& [key, block] : cache.blocks) block.used = false;
+   for(auto& [path, module] : cache.modules) module.used = false;
+}
+
+// Drops what the run did not use (like save_scan_cache) so that the cache
+// does not grow without bound
+ResidentCacheLoan::~ResidentCacheLoan()
+{
+   if(resident == nullptr) return;
+   auto prune = [](auto& map, auto is_stale) {
+      for(auto ii = map.begin(); ii != map.end();)
+         ii = is_stale(ii->second) ? map.erase(ii) : std::next(ii);
+   };
+   prune(cache.dirs, [](const auto& dir) { return !dir.used; });
+   prune(cache.blocks, [](const auto& block) { return !block.used; });
+   prune(cache.modules,
+         [](const auto& module) { return !module.used || !module.settled; });
+   swap_scan_caches(*resident, cache);
+}
+
+// ---------------------------------------------------------------------- engine
+
+Engine::Engine()
+    : resident(std::make_unique<ScanCache>())
+{}
+
+Engine::~Engine() = default;
+
+bool generate(Engine* engine, Generation& generation)
+{
+   const auto& opts = generation.opts;
+   if(generation.sink && !opts.configs.empty()) {
+      fprintf(generation.err,
+              "--config writes each configuration to its own file, not to "
+              "a sink\n");
+      return false;
+   }
+
+   string output;
+   Run run(opts);
+   run.err         = generation.err;
+   run.resident    = (engine == nullptr) ? nullptr : engine->resident.get();
+   run.input       = generation.input;
+   run.environment = generation.environment;
+   if(generation.sink) run.captured = &output;
+
+   const bool success        = run_mobius(run);
+   generation.listed_dirs    = std::move(run.listed_dirs);
+   generation.read_files     = std::move(run.read_files);
+   generation.shards_changed = run.shards_changed;
+   if(success && generation.sink) generation.sink(output);
+   return success;
+}
+
+bool write_file_if_changed(const string& filename, string_view contents)
+{
+   WriteIfChanged file;
+   open_write_if_changed(file, filename);
+   write_if_changed(file, contents);
+   return commit_write_if_changed(file);
+}
+
+} // namespace mobius
@@ -0,0 +1,155 @@
+// Copyright (c) 2018, Aaron Michaux
+// All rights reserved.
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// The mobius engine, as a library. The command line (main.cpp) is one
+// client of it; a build driver can be another, and keep an Engine, with its
+// caches, for as long as it likes. There is no chdir(2), and no signal
+// handling, and relative paths are relative to the process's working
+// directory. Messages go to the FILE* that the caller passes (stderr by
+// default), and output to the caller's sink, if it passes one; otherwise to
+// the files that Options name, where "-" is stdout. Variables come from the
+// caller's environment map, if it passes one, and getenv(3) otherwise.
+
+#ifndef MOBIUS_HPP_INCLUDED
+#define MOBIUS_HPP_INCLUDED
+
+#include <stdio.h>
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace mobius
+{
+// What can be said on the command line; see 'mobius -h'
+struct Options
+{
+   bool show_help                         = false;
+   bool has_error                         = false;
+   bool unity_build                       = true; // unity= (--no-unity)
+   bool check_modules                     = false; // --check-modules
+   bool module_depth                      = false; // --module-depth
+   bool regex_globs                       = false;
+   bool shard_output                      = false;
+   unsigned n_threads                     = 0; // 0 => all cores
+   std::string module_dir                 = "";
+   std::string in_file                    = "";
+   std::string out_file                   = "";
+   std::string cache_file                 = "";
+   std::string timings_file               = "";
+   std::string trace_file                 = "";
+   std::string depfile                    = ""; // --depfile <filename>
+   std::string dyndep_dir                 = ""; // --dyndep <dirname>
+   std::string scan_deps_file             = ""; // --scan-deps <filename>
+   std::string primary_output             = ""; // with --scan-deps
+   bool collate                           = false;
+   std::vector<std::string> collate_files = {}; // with --collate
+   bool show_stats                        = false;
+   std::string serve_socket               = ""; // --serve <socket>
+   std::string connect_socket             = ""; // --connect <socket>
+   std::string diff_file                  = ""; // --diff <filename>
+
+   // The mobius executable, which the output runs with --depfile and
+   // --dyndep. The command line sets it; a build driver must.
+   std::string mobius_command = "";
+
+   std::unordered_map<std::string, std::string> defines = {};
+   std::vector<
+       std::pair<std::string, std::unordered_map<std::string, std::string>>>
+       configs = {}; // --config <name>[:-D<var=value>...]
+};
+
+struct ScanCache;
+
+// Keeps directory listings, '?' scans, and the output of +src blocks in
+// memory between generations (as --serve does), so that a generation only
+// redoes what changed since the last. Runs one generation at a time.
+struct Engine
+{
+   Engine();
+   Engine(const Engine&) = delete;
+   Engine& operator=(const Engine&) = delete;
+   ~Engine();
+
+   std::unique_ptr<ScanCache> resident;
+};
+
+// One generation of a ninja file. Left as it is, it's the command line's:
+// it reads 'opts.in_file' and the environment, and writes 'opts.out_file'
+// (either of which may be "-"). Each can be replaced.
+struct Generation
+{
+   explicit Generation(const Options& opts_)
+       : opts(opts_)
+   {}
+
+   const Options& opts;
+   FILE* err{stderr};                 // for messages
+   const std::string* input{nullptr}; // instead of 'opts.in_file'
+
+   // Instead of getenv(3)
+   const std::unordered_map<std::string, std::string>* environment{nullptr};
+
+   // Takes the output, instead of 'opts.out_file'. Called once, with all of
+   // it, and only if the generation succeeds. Not with --config, where each
+   // configuration writes its own output file.
+   std::function<void(std::string_view)> sink;
+
+   // What the output depends on, as absolute paths; set with an Engine
+   std::vector<std::string> listed_dirs; // every directory walked
+   std::vector<std::string> read_files;  // the input, and every file read
+   bool shards_changed{false};           // some shard (--shard) was rewritten
+};
+
+// Options from a command line, as the 'mobius' executable takes it. Errors
+// are printed to 'err', and set 'has_error'.
+Options parse_commandline(int argc, char** argv, FILE* err = stderr);
+
+// Runs one generation, with the engine's caches if 'engine' is not null.
+// Returns FALSE, having printed why to 'generation.err', on failure.
+bool generate(Engine* engine, Generation& generation);
+
+// The build-time halves of --dyndep: --scan-deps, and --collate. Each
+// writes 'opts.out_file', or hands its output to 'sink' if it is set.
+// Returns FALSE, having printed why to 'err', on failure.
+bool scan_deps(const Options& opts,
+               FILE* err = stderr,
+               const std::function<void(std::string_view)>& sink = nullptr);
+bool collate(const Options& opts,
+             FILE* err = stderr,
+             const std::function<void(std::string_view)>& sink = nullptr);
+
+// Writes 'contents' to 'filename', unless the file already holds exactly
+// that, so that its mtime (which ninja watches) is left alone. Returns TRUE
+// if the file was written. Throws on error.
+bool write_file_if_changed(const std::string& filename,
+                           std::string_view contents);
+
+// Updates the mtime of 'filename'
+void touch_file(const std::string& filename);
+
+} // namespace mobius
+
+#endif // MOBIUS_HPP_INCLUDED
@@ -0,0 +1,6 @@
+#!/bin/bash
+
+# Diffs the output against a hand-edited copy, which uses escapes, '$'
+# line continuations, '|', '||' and '|@' inputs, and indented bindings
+
+"$1" -i build.mobius -o build.ninja --diff old.ninja 2>&1 || echo "exit status $?"
@@ -0,0 +1,31 @@
+#!/bin/bash
+
+# Writes a manifest with --dyndep, then does what ninja would with it: runs
+# each mobius_scan edge (--scan-deps), and collates the scans (--collate)
+# from a response file
+
+MOBIUS="$1"
+
+set -e
+
+"$MOBIUS" -m M --dyndep D -i build.mobius -o build.ninja
+echo "---- build.ninja"
+sed "s|$MOBIUS|mobius|" build.ninja
+
+# 'build <scan>: mobius_scan <source>', then 'primary_output = <output>'
+awk '$3 == "mobius_scan" { scan = $2; sub(/:$/, "", scan); source = $4 }
+     $1 == "primary_output" && scan != "" { print scan, source, $3; scan = "" }' \
+    build.ninja | while read SCAN SOURCE OUTPUT ; do
+    mkdir -p "$(dirname "$SCAN")"
+    "$MOBIUS" --scan-deps "$SOURCE" --primary-output "$OUTPUT" -o "$SCAN"
+    echo "---- $SCAN"
+    cat "$SCAN"
+done
+
+# other.ddi is another scanner's: compact, with escapes and members that
+# mobius does not write
+ls D/0/src/*.ddi > D/0.dd.rsp
+echo other.ddi >> D/0.dd.rsp
+"$MOBIUS" --collate @D/0.dd.rsp -m M -o D/0.dd
+echo "---- D/0.dd"
+cat D/0.dd
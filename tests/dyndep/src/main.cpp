@@ -0,0 +1,6 @@
+// Uses m
+module;
+#include "x.h"
+import m;
+import "y.h";
+int main() {}
@@ -0,0 +1,35 @@
+#!/bin/bash
+
+# Lists files from the git index, with from=git and from=git+untracked, in
+# index versions 2, 3 (intent-to-add sets an extended flag) and 4 (prefix
+# compressed paths).
+
+MOBIUS="$1"
+
+set -e
+export GIT_CONFIG_GLOBAL=/dev/null GIT_CONFIG_NOSYSTEM=1
+
+git init -q .
+echo "ignored.cpp" > src/.gitignore
+git add src
+git rm -q --cached src/staged-delete.cpp && rm src/staged-delete.cpp
+rm src/unstaged-delete.cpp
+touch src/untracked.cpp src/ignored.cpp
+
+run()
+{
+    echo "---- $1, index version $(od -An -tu1 -j7 -N1 .git/index | tr -d ' ')"
+    sed "s/from=git/from=$1/" build.mobius > gen.mobius
+    "$MOBIUS" -i gen.mobius 2>&1 || echo "exit status $?"
+}
+
+run git
+run git+untracked
+
+touch src/intent.cpp
+git add -N src/intent.cpp
+run git
+
+git update-index --index-version 4
+run git
+run git+untracked
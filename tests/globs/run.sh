@@ -0,0 +1,27 @@
+#!/bin/bash
+
+# Matches each pattern in patterns.txt against the files of src, with the
+# glob matcher and with --regex-globs (which treats '[', ']' and '\' as
+# literals, and '**/' as '*' then '*/'), and prints the files matched, or
+# 'same' where they agree
+
+MOBIUS="$1"
+
+matches()
+{
+    printf '+src src\n- %s build x: r ^\n' "$1" > gen.mobius
+    shift
+    "$MOBIUS" -i gen.mobius "$@" 2>&1 | sed -n 's/^build x: r //p' | tr '\n' ' ' | sed 's/ $//'
+}
+
+while read -r PATTERN ; do
+    GLOB="$(matches "$PATTERN")"
+    REGEX="$(matches "$PATTERN" --regex-globs)"
+    echo "---- $PATTERN"
+    if [ "$GLOB" = "$REGEX" ] ; then
+        echo "   same:  $GLOB"
+    else
+        echo "   glob:  $GLOB"
+        echo "   regex: $REGEX"
+    fi
+done < patterns.txt
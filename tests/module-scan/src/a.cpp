@@ -0,0 +1,4 @@
+
+// Builds every src/*.cpp file
+import foo;
+import bar;
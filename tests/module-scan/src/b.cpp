@@ -0,0 +1,5 @@
+module;
+#include "x/*.h"
+#include <y/*.h>
+export module b;
+import baz;
@@ -0,0 +1,5 @@
+#if 0
+const char* s = "/*";
+#endif
+/* a real comment */ export module c;
+import qux;
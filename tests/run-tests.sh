@@ -0,0 +1,44 @@
+#!/bin/bash
+
+# Runs each test in tests/<name>, in a scratch copy of that directory:
+#
+#  + If there is a run.sh, then it is run with the path of mobius as its
+#    argument, and its output is compared against expected.txt.
+#  + Otherwise, mobius is run on build.mobius, with '-m M', and its output
+#    is compared against expected.ninja.
+#
+# Usage: tests/run-tests.sh [path/to/mobius]
+
+set -e
+
+MOBIUS="$(realpath "${1:-./mobius}")"
+
+cd "$(dirname "$0")"
+
+TMPD=$(mktemp -d /tmp/$(basename $0).XXXXX)
+trap cleanup EXIT
+cleanup()
+{
+    rm -rf $TMPD
+}
+
+FAILED=0
+for DIR in */ ; do
+    DIR="${DIR%/}"
+    cp -r "$DIR" $TMPD/
+    if [ -f "$DIR/run.sh" ] ; then
+        EXPECTED="$PWD/$DIR/expected.txt"
+        CMD=(./run.sh "$MOBIUS")
+    else
+        EXPECTED="$PWD/$DIR/expected.ninja"
+        CMD=("$MOBIUS" -m M -i build.mobius)
+    fi
+    if (cd $TMPD/$DIR && "${CMD[@]}" 2>&1 | diff -u "$EXPECTED" -) ; then
+        echo "pass: $DIR"
+    else
+        echo "FAIL: $DIR"
+        FAILED=1
+    fi
+done
+
+exit $FAILED
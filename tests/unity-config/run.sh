@@ -0,0 +1,17 @@
+#!/bin/bash
+
+# Two configurations, written in parallel, of a block with unity=8
+
+"$1" -i build.mobius -o 'build-{config}.ninja' \
+     --config linux:-DPLATFORM=linux --config win:-DPLATFORM=win || exit 1
+
+for F in build-linux.ninja build-win.ninja ; do
+    echo "---- $F"
+    cat $F
+    for UNITY in $(grep -o 'unity/[^ ]*\.cpp$' $F) ; do
+        echo "---- $UNITY"
+        cat $UNITY
+    done
+done
+ls unity/*.tmp* 2>/dev/null
+exit 0